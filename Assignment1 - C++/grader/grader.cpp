@@ -314,20 +314,9 @@ void GradingSession::run(size_t num_threads,
   });
 
   // stdout checker thread
-  go([&g, commands_size = commands.size()]() {
+  go([&g]() {
     try {
-      // every output line corresponds to at most 2 lines
-      // cancels: exactly 1
-      // buysell: at most 2, 1 when it enters book, 1 more when it gets
-      //          fully filled
-      // execute:
-      //  - partially fulfils resting: at most 1 line,
-      //                               since new order is fully matched
-      //  - fully fulfils resting: 0 lines + remaining lines,
-      //                           since we consider this line
-      //                           as belonging to the resting order
-      // total count of all execute lines is at most 0+0+0+...+1 = 1
-      g.output_thread(commands_size * 2);
+      g.output_thread();
       {
         std::scoped_lock lock{g.exit_mut};
         g.output_thread_done = true;
@@ -782,26 +771,6 @@ struct InstBook {
   }
 };
 
-static auto groupbytimestamp(
-    const std::vector<ParsedEngineOutput> &outputs) {
-  std::vector<
-      std::vector<std::reference_wrapper<const ParsedEngineOutput>>>
-      groups;
-  if (outputs.empty()) {
-    return groups;
-  }
-  groups.emplace_back();
-  auto prev_timestamp = outputs.front().output_timestamp;
-  for (const auto &output : outputs) {
-    if (output.output_timestamp != prev_timestamp) {
-      groups.emplace_back();
-    }
-    prev_timestamp = output.output_timestamp;
-    groups.back().push_back(std::cref(output));
-  }
-  return groups;
-}
-
 /* static auto permutations( */
 /*     std::vector<std::reference_wrapper<const ParsedEngineOutput>> */
 /*         outputs) { */
@@ -837,137 +806,633 @@ static auto groupbytimestamp(
 /*   return permutations; */
 /* } */
 
-template <PriorityType PType, SortByTimestampType SType>
-static void check_correctness_outputset(
-    std::unordered_map<uint32_t, OrderStatus> &orders,
+// Checks a single output line against (and applies it to) the book of
+// the instruments it touches.
+template <PriorityType PType, SortByTimestampType SType, typename Orders>
+static void check_correctness_output(
+    Orders &orders,
     std::unordered_map<std::string, InstBook<PType, SType>> &book,
-    const std::vector<std::reference_wrapper<const ParsedEngineOutput>>
-        &outputset) {
-  for (const auto &output_ref : outputset) {
-    const auto &output = output_ref.get();
-    std::cout << "Checking: " << output.line << std::flush;
-    switch (output.type) {
-      case EngineOutputType::Buy:
-      case EngineOutputType::Sell: {
-        auto &status =
-            at(orders, output.buysell.order_id, "order does not exist");
-        auto correct_side = output.type == EngineOutputType::Buy
-                                ? EngineCommandType::Buy
-                                : EngineCommandType::Sell;
-
-        check(status.state == OrderState::Active,
-              "booking inactive order");
-        check(status.type == correct_side, "incorrect side");
-        check(status.filled_count < status.count,
-              "booking fully filled order");
-        check(std::strcmp(status.instrument.c_str(),
-                          output.buysell.instrument) == 0,
-              "incorrect instrument");
-        check(status.price == output.buysell.price, "incorrect price");
-
-        status.state = OrderState::Booked;
-        status.input_timestamp = output.input_timestamp;
-        status.added_to_book_timestamp = output.output_timestamp;
-
-        if (output.type == EngineOutputType::Buy) {
-          book[status.instrument].add_buy(output.buysell, &status);
-        } else {
-          book[status.instrument].add_sell(output.buysell, &status);
-        }
+    const ParsedEngineOutput &output) {
+  switch (output.type) {
+    case EngineOutputType::Buy:
+    case EngineOutputType::Sell: {
+      auto &status =
+          at(orders, output.buysell.order_id, "order does not exist");
+      auto correct_side = output.type == EngineOutputType::Buy
+                              ? EngineCommandType::Buy
+                              : EngineCommandType::Sell;
+
+      check(status.state == OrderState::Active,
+            "booking inactive order");
+      check(status.type == correct_side, "incorrect side");
+      check(status.filled_count < status.count,
+            "booking fully filled order");
+      check(std::strcmp(status.instrument.c_str(),
+                        output.buysell.instrument) == 0,
+            "incorrect instrument");
+      check(status.price == output.buysell.price, "incorrect price");
+
+      status.state = OrderState::Booked;
+      status.input_timestamp = output.input_timestamp;
+      status.added_to_book_timestamp = output.output_timestamp;
+
+      if (output.type == EngineOutputType::Buy) {
+        book[status.instrument].add_buy(output.buysell, &status);
+      } else {
+        book[status.instrument].add_sell(output.buysell, &status);
+      }
 
-        break;
+      break;
+    }
+
+    case EngineOutputType::Exec: {
+      auto &resting_status = at(orders, output.exec.resting_order_id,
+                                "resting order does not exist");
+      auto &new_status = at(orders, output.exec.new_order_id,
+                            "new order does not exist");
+
+      check(resting_status.state == OrderState::Booked,
+            "resting order not in book");
+      check(new_status.state == OrderState::Active,
+            "new order not active");
+      check(resting_status.price == output.exec.price,
+            "incorrect price");
+      check(resting_status.instrument == new_status.instrument,
+            "matched orders for different instruments");
+
+      if (new_status.type == EngineCommandType::Buy) {
+        book[resting_status.instrument].execute_buy(output.exec);
+      } else {
+        book[resting_status.instrument].execute_sell(output.exec);
       }
 
-      case EngineOutputType::Exec: {
-        auto &resting_status = at(orders, output.exec.resting_order_id,
-                                  "resting order does not exist");
-        auto &new_status = at(orders, output.exec.new_order_id,
-                              "new order does not exist");
-
-        check(resting_status.state == OrderState::Booked,
-              "resting order not in book");
-        check(new_status.state == OrderState::Active,
-              "new order not active");
-        check(resting_status.price == output.exec.price,
-              "incorrect price");
-        check(resting_status.instrument == new_status.instrument,
-              "matched orders for different instruments");
-
-        if (new_status.type == EngineCommandType::Buy) {
-          book[resting_status.instrument].execute_buy(output.exec);
-        } else {
-          book[resting_status.instrument].execute_sell(output.exec);
-        }
+      new_status.filled_count += output.exec.count;
 
-        new_status.filled_count += output.exec.count;
+      check(resting_status.filled_count <= resting_status.count,
+            "resting order filled more than initial quantity");
+      check(new_status.filled_count <= new_status.count,
+            "new order filled more than initial quantity");
 
-        check(resting_status.filled_count <= resting_status.count,
-              "resting order filled more than initial quantity");
-        check(new_status.filled_count <= new_status.count,
-              "new order filled more than initial quantity");
+      if (new_status.filled_count == new_status.count) {
+        new_status.state = OrderState::Filled;
+      }
+      if (resting_status.filled_count == resting_status.count) {
+        resting_status.state = OrderState::Filled;
+      }
 
-        if (new_status.filled_count == new_status.count) {
-          new_status.state = OrderState::Filled;
-        }
-        if (resting_status.filled_count == resting_status.count) {
-          resting_status.state = OrderState::Filled;
-        }
+      break;
+    }
 
-        break;
+    case EngineOutputType::Cancel: {
+      auto &status = at(orders, output.cancel.order_id,
+                        "cancel order does not exist");
+
+      if (output.cancel.cancel_type == CancelType::Accept) {
+        check(status.state == OrderState::Booked,
+              "accepted cancel for order not in book");
+      } else {
+        check(status.state != OrderState::Booked,
+              "rejected cancel for order in book");
       }
 
-      case EngineOutputType::Cancel: {
-        auto &status = at(orders, output.cancel.order_id,
-                          "cancel order does not exist");
+      book[status.instrument].cancel(output.cancel);
 
-        if (output.cancel.cancel_type == CancelType::Accept) {
-          check(status.state == OrderState::Booked,
-                "accepted cancel for order not in book");
-        } else {
-          check(status.state != OrderState::Booked,
-                "rejected cancel for order in book");
+      break;
+    }
+
+    case EngineOutputType::Invalid: {
+      assert(false);  // Should be filtered out already
+      break;
+    }
+  }
+}
+
+// Fixed set of worker threads that verification shards run on.
+class VerificationPool {
+  std::mutex mut;
+  std::condition_variable cond;
+  std::queue<std::function<void()>> tasks;
+  std::vector<std::thread> workers;
+  bool stopping{false};
+
+  void worker() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock lock{mut};
+        cond.wait(lock, [this]() { return stopping || !tasks.empty(); });
+        if (tasks.empty()) {
+          return;
         }
+        task = std::move(tasks.front());
+        tasks.pop();
+      }
+      task();
+    }
+  }
+
+ public:
+  explicit VerificationPool(size_t num_workers) {
+    for (size_t i = 0; i < num_workers; ++i) {
+      workers.emplace_back(&VerificationPool::worker, this);
+    }
+  }
+
+  ~VerificationPool() {
+    {
+      std::scoped_lock lock{mut};
+      stopping = true;
+    }
+    cond.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
 
-        book[status.instrument].cancel(output.cancel);
+  size_t size() const { return workers.size(); }
 
+  // Runs every job on the pool and waits for all of them to finish.
+  void run_all(std::vector<std::function<void()>> &jobs) {
+    std::latch done{static_cast<ptrdiff_t>(jobs.size())};
+    {
+      std::scoped_lock lock{mut};
+      for (auto &job : jobs) {
+        tasks.push([&job, &done]() {
+          job();
+          done.count_down();
+        });
+      }
+    }
+    cond.notify_all();
+    done.wait();
+  }
+};
+
+// Checks the engine output against one interpretation of the
+// requirements as it arrives. Only the outputs sharing the latest output
+// timestamp are held back (as a group), so that an error inside the group
+// can still be reported as "might not be a bug".
+class OutputChecker {
+ protected:
+  std::optional<std::string> failure;
+
+ public:
+  const char *name;
+
+  explicit OutputChecker(const char *name) : name{name} {}
+  virtual ~OutputChecker() = default;
+  virtual void feed(const ParsedEngineOutput &output) = 0;
+  virtual void finish() = 0;
+
+  void fail(std::string reason) {
+    if (!failure) {
+      failure = std::move(reason);
+    }
+  }
+  bool failed() const { return failure.has_value(); }
+  const std::string &error() const { return failure.value(); }
+};
+
+// Where an order is checked: the shard owning its instrument, and its
+// place among the orders of that shard.
+struct OrderPlace {
+  size_t shard;
+  size_t slot;
+};
+
+// The statuses of the orders one shard checks. A status is copied from the
+// orders sent, which all checkers share, once an output names the order. It
+// is dropped once the order has left the book, fully filled or cancelled,
+// and only a bit says that it did; should a later output name the order
+// again, it is given back as filled.
+class ShardOrders {
+  const std::unordered_map<uint32_t, OrderStatus> &sent;
+  const std::unordered_map<uint32_t, OrderPlace> &place_of;
+  std::unordered_map<uint32_t, OrderStatus> live;
+  std::vector<bool> retired;
+
+ public:
+  ShardOrders(const std::unordered_map<uint32_t, OrderStatus> &sent,
+              const std::unordered_map<uint32_t, OrderPlace> &place_of,
+              size_t size)
+      : sent{sent}, place_of{place_of}, retired(size) {}
+
+  // Throws std::out_of_range for an order this shard does not know.
+  OrderStatus &at(uint32_t order_id) {
+    auto it = live.find(order_id);
+    if (it != live.end()) {
+      return it->second;
+    }
+    auto place = place_of.find(order_id);
+    if (place == place_of.end()) {
+      throw std::out_of_range{"unknown order"};
+    }
+    auto &status = live.emplace(order_id, sent.at(order_id)).first->second;
+    if (retired[place->second.slot]) {
+      status.filled_count = status.count;
+      status.state = OrderState::Filled;
+    }
+    return status;
+  }
+
+  // Drops the order if it is out of the book, once an output is applied.
+  void settle(uint32_t order_id) {
+    auto it = live.find(order_id);
+    if (it == live.end() || it->second.state != OrderState::Filled) {
+      return;
+    }
+    retired[place_of.at(order_id).slot] = true;
+    live.erase(it);
+  }
+};
+
+// Instruments are independent, so each checker splits its orders and
+// books into one shard per pool worker by instrument. Completed groups
+// are collected into batches, and each batch is verified by all shards
+// in parallel. The earliest failing output of the batch (over all
+// shards) is the one reported, exactly as a single-threaded pass would.
+template <PriorityType PType, SortByTimestampType SType>
+class StreamingChecker final : public OutputChecker {
+  static constexpr size_t BATCH_OUTPUTS = 4096;
+
+  struct Shard {
+    ShardOrders orders;
+    std::unordered_map<std::string, InstBook<PType, SType>> book;
+    std::vector<size_t> batch;  // indices into StreamingChecker::batch
+    std::optional<std::pair<size_t, std::string>> failure;
+  };
+
+  struct Batched {
+    ParsedEngineOutput output;
+    size_t group_size;
+  };
+
+  VerificationPool &pool;
+  const std::unordered_map<uint32_t, OrderPlace> &place_of;
+  std::vector<Shard> shards;
+  std::vector<ParsedEngineOutput> group;
+  std::vector<Batched> batch;
+
+  // The statuses of the two orders of an execution between shards.
+  struct CrossShardOrders {
+    StreamingChecker &checker;
+
+    OrderStatus &at(uint32_t order_id) {
+      const auto &place = checker.place_of.at(order_id);
+      return checker.shards[place.shard].orders.at(order_id);
+    }
+  };
+
+  // The shard owning the instrument of the order(s) in this output, or
+  // nullopt for an execution between orders of different instruments.
+  // Unknown order ids go to shard 0, which will report them as such.
+  std::optional<size_t> route(const ParsedEngineOutput &output) const {
+    auto shard = [this](uint32_t order_id) -> std::optional<size_t> {
+      auto it = place_of.find(order_id);
+      if (it == place_of.end()) {
+        return std::nullopt;
+      }
+      return it->second.shard;
+    };
+    switch (output.type) {
+      case EngineOutputType::Buy:
+      case EngineOutputType::Sell:
+        return shard(output.buysell.order_id).value_or(0);
+      case EngineOutputType::Exec: {
+        auto resting = shard(output.exec.resting_order_id);
+        auto active = shard(output.exec.new_order_id);
+        if (resting && active && *resting != *active) {
+          return std::nullopt;
+        }
+        return resting.value_or(active.value_or(0));
+      }
+      case EngineOutputType::Cancel:
+        return shard(output.cancel.order_id).value_or(0);
+      case EngineOutputType::Invalid:
         break;
+    }
+    return 0;
+  }
+
+  void verify_shard(Shard &shard) {
+    for (size_t i : shard.batch) {
+      try {
+        const auto &output = batch[i].output;
+        check_correctness_output<PType, SType>(shard.orders, shard.book,
+                                               output);
+        switch (output.type) {
+          case EngineOutputType::Exec:
+            shard.orders.settle(output.exec.resting_order_id);
+            shard.orders.settle(output.exec.new_order_id);
+            break;
+          case EngineOutputType::Cancel:
+            shard.orders.settle(output.cancel.order_id);
+            break;
+          default:
+            break;
+        }
+      } catch (const std::runtime_error &err) {
+        shard.failure = std::make_pair(i, std::string{err.what()});
+        return;
       }
+    }
+  }
 
-      case EngineOutputType::Invalid: {
-        assert(false);  // Should be filtered out already
+  // An execution between orders of different shards always fails, but
+  // which of its checks fails first depends on the statuses in both, so it
+  // is checked on its own, once every output before it has been.
+  std::string verify_across_shards(const ParsedEngineOutput &output) {
+    CrossShardOrders orders{*this};
+    auto &book =
+        shards[place_of.at(output.exec.resting_order_id).shard].book;
+    try {
+      check_correctness_output<PType, SType>(orders, book, output);
+    } catch (const std::runtime_error &err) {
+      return err.what();
+    }
+    return "matched orders for different instruments";
+  }
+
+  void verify_batch() {
+    if (batch.empty() || failed()) {
+      batch.clear();
+      return;
+    }
+
+    // nothing after an execution between shards is checked, it fails
+    std::optional<size_t> across;
+    for (size_t i = 0; i < batch.size(); ++i) {
+      auto shard = route(batch[i].output);
+      if (!shard.has_value()) {
+        across = i;
         break;
       }
+      shards[shard.value()].batch.push_back(i);
+    }
+
+    std::vector<std::function<void()>> jobs;
+    for (auto &shard : shards) {
+      if (!shard.batch.empty()) {
+        jobs.emplace_back([this, &shard]() { verify_shard(shard); });
+      }
+    }
+    pool.run_all(jobs);
+
+    std::optional<std::pair<size_t, std::string>> first_failure;
+    for (auto &shard : shards) {
+      if (shard.failure.has_value() &&
+          (!first_failure.has_value() ||
+           shard.failure->first < first_failure->first)) {
+        first_failure = std::move(shard.failure);
+      }
+      shard.failure.reset();
+      shard.batch.clear();
     }
+    if (!first_failure.has_value() && across.has_value()) {
+      first_failure = std::make_pair(
+          across.value(), verify_across_shards(batch[across.value()].output));
+    }
+
+    if (first_failure.has_value()) {
+      const auto &[index, reason] = first_failure.value();
+      const auto &failed_output = batch[index];
+      std::cout << "Failed using " << name
+                << " at: " << failed_output.output.line << std::flush;
+      if (failed_output.group_size == 1) {
+        fail(reason);
+      } else {
+        fail(reason + std::string{", but there were "} +
+             std::to_string(failed_output.group_size) +
+             " outputs with the same "
+             "timestamp, so this might not be a bug.");
+      }
+    }
+    batch.clear();
   }
-}
 
-template <PriorityType PType, SortByTimestampType SType>
-static void check_correctness(
-    std::unordered_map<uint32_t, OrderStatus> orders,
-    const std::vector<ParsedEngineOutput> &outputs) {
-  std::unordered_map<std::string, InstBook<PType, SType>> book;
-
-  for (const auto &outputset : groupbytimestamp(outputs)) {
-    /* auto perms = permutations(outputset); */
-    if (outputset.size() == 1) {
-      check_correctness_outputset(orders, book, outputset);
+  void close_group() {
+    for (auto &output : group) {
+      batch.push_back(Batched{std::move(output), group.size()});
+    }
+    group.clear();
+    if (batch.size() >= BATCH_OUTPUTS) {
+      verify_batch();
+    }
+  }
+
+ public:
+  StreamingChecker(const char *name, VerificationPool &pool,
+                   const std::unordered_map<uint32_t, OrderPlace> &place_of,
+                   const std::vector<size_t> &shard_sizes,
+                   const std::unordered_map<uint32_t, OrderStatus> &orders)
+      : OutputChecker{name}, pool{pool}, place_of{place_of} {
+    for (size_t size : shard_sizes) {
+      shards.push_back(Shard{ShardOrders{orders, place_of, size}, {}, {}, {}});
+    }
+  }
+
+  void feed(const ParsedEngineOutput &output) override {
+    if (failed()) {
+      return;
+    }
+    if (!group.empty() &&
+        group.back().output_timestamp != output.output_timestamp) {
+      close_group();
+    }
+    group.push_back(output);
+  }
+
+  void finish() override {
+    close_group();
+    verify_batch();
+  }
+};
+
+// Restores output timestamp order for the "timestamp order"
+// interpretations. Outputs are released once they are older than the
+// newest output seen by more than REORDER_WINDOW_US, or when the engine
+// is quiescent (every command sent so far has all of its output), since
+// no output produced later can carry an earlier timestamp.
+class TimestampReorderBuffer {
+  // as the engine stamps its output, in microseconds; parsed timestamps are
+  // in nanoseconds (parse_engine_output_line)
+  static constexpr uintmax_t REORDER_WINDOW_US = 1'000'000;
+  static constexpr uintmax_t REORDER_WINDOW_NS = REORDER_WINDOW_US * 1'000;
+
+  struct Pending {
+    ParsedEngineOutput output;
+    size_t arrival;
+  };
+  struct Later {
+    bool operator()(const Pending &p1, const Pending &p2) const {
+      return p1.output.output_timestamp > p2.output.output_timestamp ||
+             (p1.output.output_timestamp == p2.output.output_timestamp &&
+              p1.arrival > p2.arrival);
+    }
+  };
+
+  std::priority_queue<Pending, std::vector<Pending>, Later> pending;
+  std::vector<OutputChecker *> sinks;
+  size_t arrivals{0};
+  uintmax_t newest_timestamp{0};
+  std::optional<uintmax_t> released_timestamp;
+
+  bool all_sinks_failed() const {
+    return std::all_of(sinks.begin(), sinks.end(),
+                       [](const OutputChecker *c) { return c->failed(); });
+  }
+
+  void release_oldest() {
+    const auto &output = pending.top().output;
+    released_timestamp = output.output_timestamp;
+    for (auto *sink : sinks) {
+      sink->feed(output);
+    }
+    pending.pop();
+  }
+
+ public:
+  void add_sink(OutputChecker *sink) { sinks.push_back(sink); }
+
+  void push(const ParsedEngineOutput &output) {
+    if (all_sinks_failed()) {
+      pending = {};
+      return;
+    }
+    if (released_timestamp.has_value() &&
+        output.output_timestamp < released_timestamp.value()) {
+      for (auto *sink : sinks) {
+        if (!sink->failed()) {
+          std::cout << "Failed using " << sink->name
+                    << " at: " << output.line << std::flush;
+          sink->fail(
+              "output arrived more than 1s after outputs with later "
+              "timestamps had been checked");
+        }
+      }
+      return;
+    }
+    newest_timestamp = std::max(newest_timestamp, output.output_timestamp);
+    pending.push(Pending{output, arrivals++});
+    while (!pending.empty() &&
+           pending.top().output.output_timestamp + REORDER_WINDOW_NS <
+               newest_timestamp) {
+      release_oldest();
+    }
+  }
+
+  void drain() {
+    while (!pending.empty()) {
+      release_oldest();
+    }
+  }
+};
+
+// All 8 interpretations, checked side by side while the engine runs.
+// Memory is bounded by the live orders plus the reorder window, rather
+// than by the total amount of output.
+class CorrectnessChecks {
+  VerificationPool pool{std::max(1u, std::thread::hardware_concurrency())};
+  std::unordered_map<uint32_t, OrderPlace> place_of;
+  std::vector<size_t> shard_sizes;
+  std::vector<std::unique_ptr<OutputChecker>> checkers;
+  std::vector<OutputChecker *> output_order;
+  TimestampReorderBuffer timestamp_order;
+
+  template <PriorityType PType, SortByTimestampType SType>
+  void add(const char *name, bool sorted_by_timestamp,
+           const std::unordered_map<uint32_t, OrderStatus> &orders) {
+    checkers.push_back(std::make_unique<StreamingChecker<PType, SType>>(
+        name, pool, place_of, shard_sizes, orders));
+    if (sorted_by_timestamp) {
+      timestamp_order.add_sink(checkers.back().get());
     } else {
-      try {
-        check_correctness_outputset(orders, book, outputset);
-      } catch (const std::runtime_error &err) {
-        throw std::runtime_error(
-            err.what() + std::string{", but there were "} +
-            std::to_string(outputset.size()) +
-            " outputs with the same "
-            "timestamp, so this might not be a bug.");
+      output_order.push_back(checkers.back().get());
+    }
+  }
+
+ public:
+  explicit CorrectnessChecks(
+      const std::unordered_map<uint32_t, OrderStatus> &orders) {
+    shard_sizes.resize(pool.size());
+    for (const auto &[order_id, status] : orders) {
+      size_t shard = std::hash<std::string>{}(status.instrument) % pool.size();
+      place_of.emplace(order_id, OrderPlace{shard, shard_sizes[shard]++});
+    }
+
+    // Same order in which the interpretations used to be tried.
+    add<PriorityType::PriceTime, SortByTimestampType::AddedToBook>(
+        "timestamp order, price-time priority, orders sorted by "
+        "added-to-book timestamp",
+        true, orders);
+    add<PriorityType::PriceTime, SortByTimestampType::Input>(
+        "timestamp order, price-time priority, orders sorted by input "
+        "timestamp",
+        true, orders);
+    add<PriorityType::PriceTime, SortByTimestampType::AddedToBook>(
+        "output order, price-time priority, orders sorted by "
+        "added-to-book timestamp",
+        false, orders);
+    add<PriorityType::PriceTime, SortByTimestampType::Input>(
+        "output order, price-time priority, orders sorted by input "
+        "timestamp",
+        false, orders);
+    add<PriorityType::Time, SortByTimestampType::AddedToBook>(
+        "timestamp order, time priority, orders sorted by added-to-book "
+        "timestamp",
+        true, orders);
+    add<PriorityType::Time, SortByTimestampType::Input>(
+        "timestamp order, time priority, orders sorted by input "
+        "timestamp",
+        true, orders);
+    add<PriorityType::Time, SortByTimestampType::AddedToBook>(
+        "output order, time priority, orders sorted by added-to-book "
+        "timestamp",
+        false, orders);
+    add<PriorityType::Time, SortByTimestampType::Input>(
+        "output order, time priority, orders sorted by input timestamp",
+        false, orders);
+  }
+
+  void feed(const ParsedEngineOutput &output) {
+    std::cout << "Checking: " << output.line << std::flush;
+    timestamp_order.push(output);
+    for (auto *checker : output_order) {
+      checker->feed(output);
+    }
+  }
+
+  // Every command sent so far has all of its output.
+  void quiesce() { timestamp_order.drain(); }
+
+  void finish() {
+    timestamp_order.drain();
+    for (const auto &checker : checkers) {
+      checker->finish();
+    }
+
+    // once a correctness test passes, we immediately return early
+    for (const auto &checker : checkers) {
+      if (!checker->failed()) {
+        std::cout << "Correct using " << checker->name << std::endl;
+        return;
       }
     }
+
+    // none of the correctness tests passed, throw error
+    std::string exc_what = "checking correctness failed.\n";
+    for (const auto &checker : checkers) {
+      exc_what += '\n';
+      exc_what += checker->name;
+      exc_what += " error: ";
+      exc_what += checker->error();
+    }
+    throw std::runtime_error(exc_what);
   }
-}
+};
 
-void GradingSession::output_thread(size_t max_output_lines) {
-  std::vector<ParsedEngineOutput> outputs;
-  outputs.reserve(max_output_lines);
+void GradingSession::output_thread() {
+  CorrectnessChecks checks{orders};
   char buf[4096];
   while (ferror(stdout_file) == 0 && feof(stdout_file) == 0) {
     if (fgets(buf, 4096, stdout_file) == nullptr) {
@@ -982,14 +1447,20 @@ void GradingSession::output_thread(size_t max_output_lines) {
       // someone fail this.
       continue;
     }
+    if (output_line.starts_with("D ")) {
+      // Depth query replies describe a book rather than an order, and are
+      // not graded.
+      std::cout << "Engine depth: " << output_line << std::flush;
+      continue;
+    }
 
     std::cout << "Engine stdout: " << output_line << std::flush;
+    ParsedEngineOutput output;
     try {
-      outputs.emplace_back(parse_engine_output_line(output_line));
+      output = parse_engine_output_line(output_line);
     } catch (const std::exception& exc) {
       throw std::runtime_error(std::string{"Could not parse engine output: "} + exc.what());
     }
-    const auto &output = outputs.back();
 
     switch (output.type) {
       case EngineOutputType::Buy:
@@ -1045,6 +1516,17 @@ void GradingSession::output_thread(size_t max_output_lines) {
       }
     }
 
+    checks.feed(output);
+
+    bool quiescent;
+    {
+      std::scoped_lock lock{active_orders_mut};
+      quiescent = active_buysell_count.size() == 0 && active_cancel.size() == 0;
+    }
+    if (quiescent) {
+      checks.quiesce();
+    }
+
     {
       std::unique_lock lock{active_orders_mut};
       active_orders_cond.wait(lock, [this]() {
@@ -1081,160 +1563,7 @@ void GradingSession::output_thread(size_t max_output_lines) {
     }
   }
 
-  std::vector<std::string> errors;
-  // check for correctness
-  // once a correctness test passes, we immediately return early
-
-  std::vector<ParsedEngineOutput> outputs_sorted = outputs;
-  std::stable_sort(
-      outputs_sorted.begin(), outputs_sorted.end(),
-      [](const ParsedEngineOutput &o1, const ParsedEngineOutput &o2) {
-        return o1.output_timestamp < o2.output_timestamp;
-      });
-
-  try {
-    std::cout << "Checking timestamp order correctness, price-time "
-                 "priority, orders sorted by added-to-book timestamp"
-              << std::endl;
-    check_correctness<PriorityType::PriceTime,
-                      SortByTimestampType::AddedToBook>(orders,
-                                                        outputs_sorted);
-    std::cout << "Correct using timestamp order correctness, price-time "
-                 "priority, orders sorted by added-to-book timestamp"
-              << std::endl;
-    return;
-  } catch (const std::exception &exc) {
-    errors.push_back(
-        std::string{"timestamp order, price-time priority, orders sorted "
-                    "by added-to-book timestamp error: "} +
-        exc.what());
-  }
-
-  try {
-    std::cout << "Checking timestamp order correctness, price-time "
-                 "priority, orders sorted by input timestamp"
-              << std::endl;
-    check_correctness<PriorityType::PriceTime,
-                      SortByTimestampType::Input>(orders, outputs_sorted);
-    std::cout << "Correct using timestamp order correctness, price-time "
-                 "priority, orders sorted by input timestamp"
-              << std::endl;
-    return;
-  } catch (const std::exception &exc) {
-    errors.push_back(
-        std::string{"timestamp order, price-time priority, orders sorted "
-                    "by input timestamp error: "} +
-        exc.what());
-  }
-
-  try {
-    std::cout << "Checking output order correctness, price-time "
-                 "priority, orders sorted by added-to-book timestamp"
-              << std::endl;
-    check_correctness<PriorityType::PriceTime,
-                      SortByTimestampType::AddedToBook>(orders, outputs);
-    std::cout << "Correct using output order correctness, price-time "
-                 "priority, orders sorted by added-to-book timestamp"
-              << std::endl;
-    return;
-  } catch (const std::exception &exc) {
-    errors.push_back(
-        std::string{"output order, price-time priority, orders sorted by "
-                    "added-to-book timestamp error: "} +
-        exc.what());
-  }
-
-  try {
-    std::cout << "Checking output order correctness, price-time "
-                 "priority, orders sorted by input timestamp"
-              << std::endl;
-    check_correctness<PriorityType::PriceTime,
-                      SortByTimestampType::Input>(orders, outputs);
-    std::cout << "Correct using output order correctness, price-time "
-                 "priority, orders sorted by input timestamp"
-              << std::endl;
-    return;
-  } catch (const std::exception &exc) {
-    errors.push_back(
-        std::string{"output order, price-time priority, orders sorted by "
-                    "input timestamp error: "} +
-        exc.what());
-  }
-
-  try {
-    std::cout << "Checking timestamp order correctness, price-time "
-                 "priority, orders sorted by added-to-book timestamp"
-              << std::endl;
-    check_correctness<PriorityType::Time,
-                      SortByTimestampType::AddedToBook>(orders,
-                                                        outputs_sorted);
-    std::cout << "Correct using timestamp order correctness, price-time "
-                 "priority, orders sorted by added-to-book timestamp"
-              << std::endl;
-    return;
-  } catch (const std::exception &exc) {
-    errors.push_back(
-        std::string{"timestamp order, time priority, orders sorted by "
-                    "added-to-book timestamp error: "} +
-        exc.what());
-  }
-
-  try {
-    std::cout << "Checking timestamp order correctness, price-time "
-                 "priority, orders sorted by input timestamp"
-              << std::endl;
-    check_correctness<PriorityType::Time, SortByTimestampType::Input>(
-        orders, outputs_sorted);
-    std::cout << "Correct using timestamp order correctness, price-time "
-                 "priority, orders sorted by input timestamp"
-              << std::endl;
-    return;
-  } catch (const std::exception &exc) {
-    errors.push_back(std::string{"timestamp order, time priority, orders "
-                                 "sorted by input timestamp error: "} +
-                     exc.what());
-  }
-
-  try {
-    std::cout << "Checking output order correctness, time-priority, "
-                 "orders sorted by added-to-book timestamp"
-              << std::endl;
-    check_correctness<PriorityType::Time,
-                      SortByTimestampType::AddedToBook>(orders, outputs);
-    std::cout << "Correct using output order correctness, time-priority, "
-                 "orders sorted by added-to-book timestamp"
-              << std::endl;
-    return;
-  } catch (const std::exception &exc) {
-    errors.push_back(
-        std::string{"output order, time priority, orders sorted by "
-                    "added-to-book timestamp error: "} +
-        exc.what());
-  }
-
-  try {
-    std::cout << "Checking output order correctness, time-priority, "
-                 "orders sorted by input timestamp"
-              << std::endl;
-    check_correctness<PriorityType::Time, SortByTimestampType::Input>(
-        orders, outputs);
-    std::cout << "Correct using output order correctness, time-priority, "
-                 "orders sorted by input timestamp"
-              << std::endl;
-    return;
-  } catch (const std::exception &exc) {
-    errors.push_back(std::string{"output order, time priority, orders "
-                                 "sorted by input timestamp error: "} +
-                     exc.what());
-  }
-
-  // none of the correctness tests passed, throw error
-  std::string exc_what = "checking correctness failed.\n";
-  for (const auto &err : errors) {
-    exc_what += '\n';
-    exc_what += err;
-  }
-  throw std::runtime_error(exc_what);
+  checks.finish();
 }
 
 GradingSession::~GradingSession() {
@@ -188,7 +188,7 @@ class GradingSession {
   explicit GradingSession(size_t num_threads)
       : num_threads{num_threads} {}
   void client_thread(size_t thread_id);
-  void output_thread(size_t max_output_lines);
+  void output_thread();
 
  public:
   GradingSession() = delete;
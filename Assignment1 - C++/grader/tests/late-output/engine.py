@@ -0,0 +1,43 @@
+#!/usr/bin/env python3
+
+# Stands in for an engine whose output comes out of timestamp order: up to
+# 1 s late for orders 3 and 4, 1.5 s late for order 5. It answers the adds
+# of late-output.in only once it has all of them, so the grader cannot
+# release them as quiescent.
+import os
+import socket
+import struct
+import sys
+import time
+
+INPUT = struct.Struct('<IIII9s3x')
+
+
+def main():
+    listener = socket.socket(socket.AF_UNIX)
+    listener.bind(sys.argv[1])
+    listener.listen()
+    connection, _ = listener.accept()
+    orders = []
+    data = b''
+    while len(orders) < 5:
+        chunk = connection.recv(INPUT.size)
+        if not chunk:
+            return
+        data += chunk
+        while len(data) >= INPUT.size:
+            kind, order_id, price, count, instrument = INPUT.unpack(data[:INPUT.size])
+            data = data[INPUT.size:]
+            orders.append((chr(kind), order_id, instrument.rstrip(b'\0').decode(), price, count))
+
+    now = time.monotonic_ns() // 1000
+    stamps = (100_000, 1_500_000, 1_000_000, 500_000, 0)
+    for (kind, order_id, instrument, price, count), stamp in zip(orders, stamps):
+        print(f'{kind} {order_id} {instrument} {price} {count} {now} {now + stamp}', flush=True)
+    while connection.recv(INPUT.size):
+        pass
+    os.unlink(sys.argv[1])
+
+
+if __name__ == '__main__':
+    main()
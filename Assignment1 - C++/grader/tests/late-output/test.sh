@@ -0,0 +1,26 @@
+#!/usr/bin/env bash
+
+# An output line read more than 1 s after an output stamped later fails the
+# "timestamp order" algorithms, one less late does not, and the "output
+# order" algorithms still pass.
+
+if [[ $# -lt 1 ]]; then
+  echo Usage: "$0" path/to/grader
+  exit 1
+fi
+
+dir="$(dirname "$0")"
+log="$(mktemp)"
+trap 'rm -f "$log"' EXIT
+
+timeout 10s "$1" "$dir/engine.py" < "$dir/late-output.in" > "$log" 2>&1
+status=$?
+if [[ $status -ne 0 ]] ||
+   ! grep -q "^Failed using timestamp order, .* at: B 5 " "$log" ||
+   grep -q "^Failed using .* at: B [1-4] " "$log" ||
+   ! grep -q "^Correct using output order" "$log"; then
+  cat "$log"
+  echo "late-output: FAILED (grader exit code $status)"
+  exit 1
+fi
+echo "late-output: passed"
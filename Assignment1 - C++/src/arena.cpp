@@ -0,0 +1,117 @@
+#include "arena.hpp"
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+char *Arena::base{nullptr};
+size_t Arena::capacity{0};
+Arena::Pages Arena::pages{Arena::Pages::Regular};
+std::atomic<size_t> Arena::used{0};
+std::atomic<Arena::Cache*> Arena::caches{nullptr};
+thread_local Arena::Cache *Arena::local{nullptr};
+
+static constexpr size_t PAGE = 4096;
+static constexpr size_t HUGE_PAGE = 2 << 20;
+
+void *Arena::Map(size_t size, bool prefault, Pages *kind) {
+    // explicit hugepages come in whole pages, and only if some are reserved
+    if (size % HUGE_PAGE == 0) {
+        void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (prefault ? MAP_POPULATE : 0), -1, 0);
+        if (memory != MAP_FAILED) {
+            if (kind != nullptr) {
+                *kind = Pages::Huge;
+            }
+            return memory;
+        }
+    }
+
+    // a transparent hugepage needs an aligned 2M range: map more, trim both ends
+    size_t mapped = size + HUGE_PAGE;
+    void *memory = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    uintptr_t start = reinterpret_cast<uintptr_t>(memory);
+    uintptr_t aligned = (start + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    uintptr_t end = (aligned + size + PAGE - 1) & ~(PAGE - 1);
+    if (aligned != start) {
+        munmap(memory, aligned - start);
+    }
+    if (end != start + mapped) {
+        munmap(reinterpret_cast<void *>(end), start + mapped - end);
+    }
+    char *region = reinterpret_cast<char *>(aligned);
+    bool transparent = madvise(region, size, MADV_HUGEPAGE) == 0;
+    if (kind != nullptr) {
+        *kind = transparent ? Pages::Transparent : Pages::Regular;
+    }
+
+    // MAP_POPULATE would have faulted the pages in before the advice
+    if (prefault) {
+        for (size_t offset = 0; offset < size; offset += PAGE) {
+            static_cast<volatile char *>(region)[offset] = 0;
+        }
+    }
+    return region;
+}
+
+bool Arena::Configure(size_t bytes) {
+    bytes = (bytes + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    void *memory = Map(bytes, true, &pages);
+    if (memory == nullptr) {
+        return false;
+    }
+    base = static_cast<char *>(memory);
+    capacity = bytes;
+    return true;
+}
+
+Arena::Faults Arena::PageFaults() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return Faults{usage.ru_minflt, usage.ru_majflt};
+}
+
+Arena::Cache &Arena::self() {
+    // the cache of this thread, left to the next thread when this one exits
+    static thread_local struct Slot {
+        Cache *cache;
+
+        Slot(): cache{nullptr} {
+            for (Cache *c = caches.load(); c != nullptr; c = c->others) {
+                bool free = false;
+                if (c->in_use.compare_exchange_strong(free, true)) {
+                    cache = c;
+                    return;
+                }
+            }
+            cache = new Cache{};
+            cache->in_use.store(true);
+            cache->others = caches.load();
+            while (!caches.compare_exchange_weak(cache->others, cache)) {
+            }
+        }
+        ~Slot() {
+            local = nullptr;
+            cache->in_use.store(false);
+        }
+    } slot;
+    local = slot.cache;
+    return *slot.cache;
+}
+
+void *Arena::carve(Cache &cache, size_t bytes) {
+    if (static_cast<size_t>(cache.end - cache.next) < bytes) {
+        // the rest of the old chunk is too small to bother keeping
+        size_t offset = used.load(std::memory_order_relaxed) < capacity ? used.fetch_add(CHUNK) : capacity;
+        if (offset + CHUNK > capacity) {
+            return ::operator new(bytes, std::align_val_t{BLOCK});
+        }
+        cache.next = base + offset;
+        cache.end = cache.next + CHUNK;
+    }
+    void *block = cache.next;
+    cache.next += bytes;
+    return block;
+}
@@ -0,0 +1,113 @@
+// This file contains the arena orders, price levels and books are allocated
+// from.
+//
+// With ENGINE_ARENA_MB set, one region of that size is mapped when the engine
+// starts: on explicit hugepages (MAP_HUGETLB) if the system has enough of
+// them reserved, else on regular pages with transparent hugepages asked for
+// (MADV_HUGEPAGE). Every page of it is touched before the first input, so
+// trading neither takes first-touch page faults nor fills the TLB with 4K
+// entries for its hottest objects.
+//
+// The region is handed out in blocks, sized in multiples of a cache line.
+// Each thread carves blocks from a chunk of its own and keeps the blocks it
+// frees on free lists of its own, one per size, so neither takes a lock.
+// Blocks freed by a thread are reused by that thread, whichever thread took
+// them first. A thread that exits leaves its chunk and lists to the next
+// thread. Once the region is used up, or without ENGINE_ARENA_MB, blocks
+// come from the heap as before.
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+class Arena {
+public:
+    enum class Pages {
+        Huge,           // MAP_HUGETLB
+        Transparent,    // regular pages, transparent hugepages asked for
+        Regular,        // the kernel would not even be asked
+    };
+    struct Faults {
+        int64_t minor;
+        int64_t major;
+    };
+
+private:
+    static constexpr size_t BLOCK = 64;
+    static constexpr size_t CLASSES = 64;   // blocks up to 4K, larger ones are heap allocated
+    static constexpr size_t CHUNK = 64 << 10;
+
+    struct Block {
+        Block *next;
+    };
+    struct Cache {
+        Block *free[CLASSES];
+        char *next;     // rest of the chunk this thread carves from
+        char *end;
+        std::atomic<bool> in_use;
+        Cache *others;
+    };
+
+    static char *base;
+    static size_t capacity;
+    static Pages pages;
+    static std::atomic<size_t> used;
+    // every cache ever made; reused, never freed
+    static std::atomic<Cache*> caches;
+    static thread_local Cache *local;
+
+    static Cache &self();
+    static void *carve(Cache &, size_t bytes);
+
+public:
+    // maps size bytes of zeroed memory on hugepages if it can, touching every
+    // page if prefault; null if the memory cannot be mapped at all
+    static void *Map(size_t size, bool prefault, Pages *pages = nullptr);
+    // maps and prefaults the region; once, before any allocation
+    static bool Configure(size_t bytes);
+    static size_t Capacity() { return capacity; }
+    // bytes handed out to threads, whether or not blocks were carved from them yet
+    static size_t Used() {
+        size_t n = used.load(std::memory_order_relaxed);
+        return n < capacity ? n : capacity;
+    }
+    static Pages PageKind() { return pages; }
+    // of the whole process, since it started
+    static Faults PageFaults();
+
+    static void *Allocate(size_t size) {
+        size_t c = (size - 1) / BLOCK;
+        if (base == nullptr || c >= CLASSES) {
+            return ::operator new(size, std::align_val_t{BLOCK});
+        }
+        Cache &cache = local != nullptr ? *local : self();
+        Block *block = cache.free[c];
+        if (block != nullptr) {
+            cache.free[c] = block->next;
+            return block;
+        }
+        return carve(cache, (c + 1) * BLOCK);
+    }
+    static void Free(void *p, size_t size) {
+        size_t c = (size - 1) / BLOCK;
+        if (reinterpret_cast<uintptr_t>(p) - reinterpret_cast<uintptr_t>(base) >= capacity) {
+            ::operator delete(p, std::align_val_t{BLOCK});
+            return;
+        }
+        Cache &cache = local != nullptr ? *local : self();
+        Block *block = static_cast<Block *>(p);
+        block->next = cache.free[c];
+        cache.free[c] = block;
+    }
+};
+
+// Declares the operators that put a class in the arena, in its body.
+#define ARENA_ALLOCATED \
+    static void *operator new(size_t size) { return Arena::Allocate(size); } \
+    static void operator delete(void *p, size_t size) { Arena::Free(p, size); }
+
+#endif
@@ -16,11 +16,29 @@
 #define INPUT_CANCEL_ORDER 'C'
 #define INPUT_BUY_ORDER 'B'
 #define INPUT_SELL_ORDER 'S'
+#define INPUT_MASS_CANCEL 'M'
+#define INPUT_AMEND_ORDER 'A'
+#define INPUT_DEPTH_QUERY 'D'
 
 static char *line_buffer;
 static size_t line_buffer_size = 0;
 static _Atomic _Bool main_is_exiting = 0;
 
+// with -b, inputs are sent in batch frames: frame[0] is the header and
+// frame_count inputs follow it
+static struct input frame[INPUT_BATCH_MAX + 1];
+static uint32_t frame_count = 0;
+
+static int flush_frame(FILE *client) {
+  if (frame_count == 0) {
+    return 0;
+  }
+  frame[0] = (struct input){.type = input_batch, .count = frame_count};
+  size_t size = sizeof(frame[0]) * (frame_count + 1);
+  frame_count = 0;
+  return fwrite(frame, 1, size, client) == size ? 0 : -1;
+}
+
 static int poll_thread(void *fdptr) {
   struct pollfd pfd = {.events = 0, .fd = (int)(long)fdptr};
   while (!main_is_exiting) {
@@ -40,10 +58,17 @@ static int poll_thread(void *fdptr) {
 }
 
 int main(int argc, char *argv[]) {
-  if (argc < 2) {
+  unsigned long batch_size = 0;
+  if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+    batch_size = strtoul(argv[2], NULL, 10);
+    argc -= 2;
+    argv += 2;
+  }
+  if (argc < 2 || batch_size > INPUT_BATCH_MAX) {
     fprintf(stderr,
-            "Usage: %s <path of socket to connect to> < <input>\n",
-            argv[0]);
+            "Usage: %s [-b <inputs per batch frame, at most %d>] "
+            "<path of socket to connect to> < <input>\n",
+            argv[0], INPUT_BATCH_MAX);
     return 1;
   }
 
@@ -90,6 +115,25 @@ int main(int argc, char *argv[]) {
           return 1;
         }
         break;
+      case INPUT_AMEND_ORDER:
+        input.type = input_amend;
+        if (sscanf(line_buffer + 1, " %u %u %u", &input.order_id,
+                   &input.price, &input.count) != 3) {
+          fprintf(stderr, "Invalid amend order: %s\n", line_buffer);
+          return 1;
+        }
+        break;
+      case INPUT_MASS_CANCEL:
+        input.type = input_mass_cancel;
+        break;
+      case INPUT_DEPTH_QUERY:
+        input.type = input_depth;
+        if (sscanf(line_buffer + 1, " %8s %u", input.instrument,
+                   &input.count) != 2) {
+          fprintf(stderr, "Invalid depth query: %s\n", line_buffer);
+          return 1;
+        }
+        break;
       case INPUT_BUY_ORDER:
         input.type = input_buy;
         goto new_order;
@@ -107,12 +151,26 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (batch_size > 0) {
+      frame[++frame_count] = input;
+      if (frame_count == batch_size && flush_frame(client) != 0) {
+        fprintf(stderr, "Failed to write batch frame\n");
+        return 1;
+      }
+      continue;
+    }
+
     if (fwrite(&input, 1, sizeof(input), client) != sizeof(input)) {
       fprintf(stderr, "Failed to write command\n");
       return 1;
     }
   }
 
+  if (flush_frame(client) != 0) {
+    fprintf(stderr, "Failed to write batch frame\n");
+    return 1;
+  }
+
   main_is_exiting = 1;
   fclose(client);
 
@@ -1,376 +1,1408 @@
 #include "engine.hpp"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <thread>
+#include <unistd.h>
 
 #include "io.h"
 
-HashMap<uint32_t, std::shared_ptr<Order>> Engine::orders{};
+// Layout of the structures matching touches. offsetof is only conditionally
+// supported on types that are not standard layout, but both gcc and clang
+// handle these.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+static_assert(alignof(Order) == CACHE_LINE && sizeof(Order) == 2 * CACHE_LINE);
+static_assert(offsetof(Order, session_next) + sizeof(Order *) <= CACHE_LINE,
+              "hot order fields spill out of the first cache line");
+static_assert(offsetof(Order, session) == CACHE_LINE);
+static_assert(alignof(OrderNode) == CACHE_LINE && sizeof(OrderNode) == 2 * CACHE_LINE);
+static_assert(offsetof(OrderNode, version) + sizeof(OrderNode::version) <= CACHE_LINE,
+              "level data spills out of the first cache line");
+static_assert(offsetof(OrderNode, m) == CACHE_LINE);
+#pragma GCC diagnostic pop
+
+OrderTable Engine::orders{};
+MarketData Engine::marketData{};
+
+static uint32_t EnvUint(const char *name, uint32_t fallback) {
+    const char *value = getenv(name);
+    if (value == nullptr || *value == '\0') {
+        return fallback;
+    }
+    return static_cast<uint32_t>(strtoul(value, nullptr, 10));
+}
+
+EngineConfig EngineConfig::FromEnvironment() {
+    EngineConfig config{};
+    const char *md_path = getenv("ENGINE_MD_PATH");
+    config.md_path = md_path != nullptr ? md_path : "";
+    config.md_snapshot_interval = EnvUint("ENGINE_MD_SNAPSHOT_INTERVAL", 1000);
+
+    const char *auction = getenv("ENGINE_AUCTION_INSTRUMENTS");
+    std::stringstream instruments{auction != nullptr ? auction : ""};
+    std::string instrument;
+    while (std::getline(instruments, instrument, ',')) {
+        auto &listed = config.auction_instruments;
+        if (!instrument.empty() && std::find(listed.begin(), listed.end(), instrument) == listed.end()) {
+            listed.push_back(instrument);
+        }
+    }
+    config.auction_interval_ms = EnvUint("ENGINE_AUCTION_INTERVAL_MS", 100);
+    config.cancel_on_disconnect = EnvUint("ENGINE_CANCEL_ON_DISCONNECT", 0) != 0;
+    config.order_table_ids = EnvUint("ENGINE_ORDER_TABLE_IDS", 0);
+    const char *stats_path = getenv("ENGINE_STATS_PATH");
+    config.stats_path = stats_path != nullptr ? stats_path : "";
+    const char *trace_path = getenv("ENGINE_TRACE_PATH");
+    config.trace_path = trace_path != nullptr ? trace_path : "trace.json";
+    config.trace_sample = EnvUint("ENGINE_TRACE_SAMPLE", 1024);
+    config.reactor_threads = EnvUint("ENGINE_REACTOR_THREADS", 0);
+    config.matching_workers = EnvUint("ENGINE_MATCHING_WORKERS", 0);
+    config.arena_mb = EnvUint("ENGINE_ARENA_MB", 0);
+    return config;
+}
+
+Engine::Engine(): orderBooks{}, auctionBooks{}, nextSessionId{0}, cancelOnDisconnect{false}, allBooksM{},
+    allBooks{}, startTime{CurrentTimestamp()}, reactor{nullptr},
+    executor{nullptr} {
+    EngineConfig config = EngineConfig::FromEnvironment();
+    OutputWriter::Configure();
+#ifdef ENGINE_TRACE
+    Trace::Configure(config.trace_path, config.trace_sample);
+#endif
+    cancelOnDisconnect = config.cancel_on_disconnect;
+
+    // warm-up: the arena and the order table are faulted in before any input
+    Arena::Faults before = Arena::PageFaults();
+    bool arena = config.arena_mb != 0 && Arena::Configure(size_t{config.arena_mb} << 20);
+    if (config.arena_mb != 0 && !arena) {
+        std::cerr << "Cannot map an arena of " << config.arena_mb << " MB, running without it" << std::endl;
+    }
+    orders.configure(config.order_table_ids, arena);
+    if (arena) {
+        static const char *const kinds[] = {"hugepages", "transparent hugepages", "regular pages"};
+        Arena::Faults after = Arena::PageFaults();
+        std::cerr << "Arena of " << config.arena_mb << " MB on " << kinds[static_cast<int>(Arena::PageKind())]
+                  << ", page faults before warm-up " << before.minor << " minor " << before.major
+                  << " major, after " << after.minor << " minor " << after.major << " major" << std::endl;
+    }
+    if (config.reactor_threads != 0 && (reactor = Reactor::Create(config.reactor_threads)) == nullptr) {
+        std::cerr << "Cannot start the reactor, serving each connection on a thread" << std::endl;
+    }
+    if (config.matching_workers != 0 && reactor != nullptr) {
+        // an input that must wait for the session's inputs in mailboxes would
+        // block a reactor thread, and every connection it serves
+        std::cerr << "Matching on the reactor's threads, ENGINE_MATCHING_WORKERS needs a thread per connection"
+                  << std::endl;
+    } else if (config.matching_workers != 0) {
+        executor = new Executor{config.matching_workers, [this](OrderBook *book) { RunBook(book); }};
+    }
+    if (!config.md_path.empty() && !marketData.open(config.md_path, config.md_snapshot_interval)) {
+        std::cerr << "Cannot open market data channel " << config.md_path
+                  << ", running without it" << std::endl;
+    }
+
+    // auction books are created up front so the auction thread knows them all
+    for (auto &instrument : config.auction_instruments) {
+        OrderBook *order_book = new OrderBook{instrument, true};
+        if (!orderBooks.put(instrument, order_book)) {
+            // the list has no duplicates, but a book made twice must not leak
+            delete order_book;
+            continue;
+        }
+        auctionBooks.push_back(order_book);
+        allBooks.push_back(order_book);
+    }
+    if (!auctionBooks.empty()) {
+        std::thread thread{&Engine::AuctionThread, this,
+                           std::chrono::milliseconds{config.auction_interval_ms}};
+        thread.detach();
+    }
+
+    if (!config.stats_path.empty()) {
+        int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, config.stats_path.c_str(), sizeof(address.sun_path) - 1);
+        // a socket left behind by an earlier run would make bind fail
+        unlink(address.sun_path);
+        if (listenfd == -1 || bind(listenfd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            listen(listenfd, 8) != 0) {
+            std::cerr << "Cannot open stats socket " << config.stats_path << ", running without it"
+                      << std::endl;
+        } else {
+            std::thread thread{&Engine::StatsThread, this, listenfd};
+            thread.detach();
+        }
+    }
+}
+
+void Engine::StatsThread(int listenfd) {
+    // rates are over the time since the previous connection, or since the start
+    Stats::Totals before{};
+    int64_t then = startTime;
+    while (true) {
+        int connfd = accept(listenfd, nullptr, nullptr);
+        if (connfd == -1) {
+            continue;
+        }
+        Stats::Totals now = Stats::Read();
+        int64_t time = CurrentTimestamp();
+        std::string report = StatsReport(now, before, time - then);
+        before = now;
+        then = time;
+        for (size_t sent = 0; sent < report.size();) {
+            ssize_t n = write(connfd, report.data() + sent, report.size() - sent);
+            if (n <= 0) {
+                break;
+            }
+            sent += n;
+        }
+        close(connfd);
+    }
+}
+
+std::string Engine::StatsReport(const Stats::Totals &now, const Stats::Totals &before, int64_t elapsed) {
+    static constexpr std::pair<Stats::Counter, const char *> rated[] = {
+        {Stats::Inputs, "inputs"}, {Stats::Orders, "orders"}, {Stats::Executions, "executions"},
+        {Stats::Cancels, "cancels"}, {Stats::Amends, "amends"}, {Stats::MassCancels, "mass_cancels"},
+        {Stats::DepthQueries, "depth_queries"}};
+
+    std::stringstream json;
+    json << "{\n  \"uptime_us\": " << CurrentTimestamp() - startTime;
+    for (auto [counter, name] : rated) {
+        int64_t count = now.counters[counter];
+        double rate = elapsed > 0 ? (count - before.counters[counter]) * 1e6 / elapsed : 0;
+        json << ",\n  \"" << name << "\": " << count << ", \"" << name << "_per_s\": "
+             << static_cast<int64_t>(rate);
+    }
+    json << ",\n  \"connections\": " << now.counters[Stats::Connections];
+    json << ",\n  \"retired\": " << now.counters[Stats::Retired]
+         << ", \"awaiting_free\": " << now.counters[Stats::Retired] - now.counters[Stats::Freed];
+    Arena::Faults faults = Arena::PageFaults();
+    json << ",\n  \"page_faults\": {\"minor\": " << faults.minor << ", \"major\": " << faults.major << "}";
+    json << ",\n  \"arena\": {\"bytes\": " << Arena::Capacity() << ", \"used\": " << Arena::Used() << "}";
+    json << ",\n  \"latency_us\": {\"p50\": " << Stats::Percentile(now, 0.5)
+         << ", \"p90\": " << Stats::Percentile(now, 0.9) << ", \"p99\": " << Stats::Percentile(now, 0.99)
+         << ", \"p999\": " << Stats::Percentile(now, 0.999) << "}";
+
+    // the books are read like a depth query, without their locks
+    std::vector<OrderBook*> books;
+    {
+        std::lock_guard<std::mutex> lock{allBooksM};
+        books = allBooks;
+    }
+    Epoch::Guard guard;
+    std::vector<LevelView> bids, asks;
+    int64_t live = 0;
+    json << ",\n  \"books\": " << books.size() << ",\n  \"levels\": {";
+    for (size_t i = 0; i < books.size(); i++) {
+        books[i]->buyBook.depth(SIZE_MAX, bids);
+        books[i]->sellBook.depth(SIZE_MAX, asks);
+        for (auto *side : {&bids, &asks}) {
+            for (const LevelView &level : *side) {
+                live += level.orders;
+            }
+        }
+        json << (i == 0 ? "" : ", ") << "\"" << books[i]->instrument << "\": {\"bids\": " << bids.size()
+             << ", \"asks\": " << asks.size() << "}";
+    }
+    json << "},\n  \"live_orders\": " << live << "\n}\n";
+    return json.str();
+}
+
+void Engine::AuctionThread(std::chrono::milliseconds interval) {
+    while (true) {
+        std::this_thread::sleep_for(interval);
+        Epoch::Guard guard;
+        for (OrderBook *order_book : auctionBooks) {
+            order_book->runAuction();
+        }
+        marketData.Flush();
+        OutputWriter::Flush();
+    }
+}
 
 void Engine::Accept(ClientConnection connection) {
+    if (reactor != nullptr) {
+        reactor->Start(ConnectionTask(std::move(connection)));
+        return;
+    }
     std::thread thread{&Engine::ConnectionThread, this,
                        std::move(connection)};
     thread.detach();
 }
 
 void Engine::ConnectionThread(ClientConnection connection) {
+    Session *session = new Session{++nextSessionId};
+    Stats::Count(Stats::Connections);
+    BookCache books;
+    std::vector<input> frame;
+    std::vector<OrderBook*> snapshots;
+    std::vector<OrderBook*> held;
     while (true) {
         input input;
-        switch (connection.ReadInput(input)) {
+        ReadResult result = connection.ReadInput(input);
+        frame.assign(1, input);
+        if (result == ReadResult::Success && input.type == input_batch) {
+            // a batch frame is followed by count inputs
+            if (input.count > INPUT_BATCH_MAX) {
+                result = ReadResult::Error;
+            } else {
+                frame.resize(input.count);
+                result = connection.ReadInputs(frame.data(), frame.size());
+            }
+        }
+        switch (result) {
             case ReadResult::Error:
                 std::cerr << "Error reading input" << std::endl;
+                [[fallthrough]];
             case ReadResult::EndOfFile:
+                Disconnect(*session);
                 return;
             case ReadResult::Success:
                 break;
         }
-        int64_t input_time = CurrentTimestamp();
-        switch (input.type) {
-            case input_cancel:
-//                std::cout << "Got cancel: ID: " << input.order_id << std::endl;
-//                Output::OrderDeleted(input.order_id, true, input_time,
-//                                     CurrentTimestamp());
-                break;
-            default:
-//                std::cout << "Got order: " << static_cast<char>(input.type) << " "
-//                          << input.instrument << " x " << input.count << " @ "
-//                          << input.price << " ID: " << input.order_id
-//                          << std::endl;
-                break;
+        if (executor != nullptr) {
+            // the workers match the books, there is nothing to hold here
+            ProcessFrame(*session, frame, books, snapshots);
+            continue;
+        }
+        // as in ConnectionTask: the books are taken once for the frame, not
+        // once per input
+        BooksOf(frame, books, held);
+        for (OrderBook *order_book : held) {
+            order_book->turn_m.lock();
+        }
+        ProcessFrame(*session, frame, books, snapshots);
+        for (OrderBook *order_book : held) {
+            order_book->turn_m.unlock();
         }
+        held.clear();
+    }
+
+}
 
-        // executing orders
-        std::shared_ptr<Order> order = std::make_shared<Order>(Order{input.type, input.order_id, input.price, input.count,
-                    input.instrument, input_time, 1});
-        switch (order->type) {
-            case input_buy: {
-                OrderBook *order_book;
-                if (!orderBooks.get(order->instrument, order_book)) {
-                    orderBooks.put(order->instrument, new OrderBook{order->instrument});
-                    orderBooks.get(order->instrument, order_book);
+Reactor::Task Engine::ConnectionTask(ClientConnection connection) {
+    Session *session = new Session{++nextSessionId};
+    Stats::Count(Stats::Connections);
+    BookCache books;
+    std::vector<input> frame;
+    std::vector<OrderBook*> snapshots;
+    std::vector<OrderBook*> held;
+    Reactor::Stream stream{*reactor, connection.Descriptor()};
+    while (true) {
+        // the whole frame is read before any of it is handled, as in ConnectionThread
+        ReadResult result = ReadResult::Success;
+        size_t want = sizeof(input);
+        input first;
+        while (true) {
+            if (stream.Buffered() >= sizeof(input)) {
+                // copied out, inputs are not aligned in the stream's buffer
+                memcpy(&first, stream.Data(), sizeof(input));
+                if (first.type == input_batch && first.count > INPUT_BATCH_MAX) {
+                    result = ReadResult::Error;
+                    break;
                 }
+                want = first.type == input_batch ? (first.count + 1) * sizeof(input) : sizeof(input);
+                if (stream.Buffered() >= want) {
+                    break;
+                }
+            }
+            ssize_t n = stream.Fill(want);
+            if (n == -1 && errno == EAGAIN) {
+                co_await stream.Wait();
+            } else if (n == 0 || (n == -1 && errno != EINTR)) {
+                result = n == 0 ? ReadResult::EndOfFile : ReadResult::Error;
+                break;
+            }
+        }
+        if (result != ReadResult::Success) {
+            if (result == ReadResult::Error) {
+                std::cerr << "Error reading input" << std::endl;
+            }
+            Disconnect(*session);
+            co_return;
+        }
+        if (first.type == input_batch) {
+            frame.resize(first.count);
+            memcpy(frame.data(), stream.Data() + sizeof(input), first.count * sizeof(input));
+        } else {
+            frame.assign(1, first);
+        }
+        stream.Consume(want);
 
-                order_book->processBuyOrder(order);
+        // the frame's books are held until it is handled, so its matching
+        // never waits for another connection's; taken in address order, two
+        // connections never wait for each other
+        BooksOf(frame, books, held);
+        for (OrderBook *order_book : held) {
+            co_await reactor->Acquire(order_book->turn);
+        }
+        ProcessFrame(*session, frame, books, snapshots);
+        for (OrderBook *order_book : held) {
+            reactor->Unlock(order_book->turn);
+        }
+        held.clear();
+    }
+}
+
+OrderBook *Engine::BookOf(const input &input, BookCache &books) {
+    switch (input.type) {
+        case input_buy:
+        case input_sell:
+            return GetOrderBook(input.instrument, books);
+        case input_cancel:
+        case input_amend: {
+            Epoch::Guard guard;
+            Order *order;
+            return Engine::orders.get(input.order_id, order) ? GetOrderBook(order->instrument, books) : nullptr;
+        }
+        default:
+            return nullptr;
+    }
+}
+
+void Engine::BooksOf(const std::vector<input> &frame, BookCache &books, std::vector<OrderBook*> &held) {
+    for (auto &in : frame) {
+        OrderBook *order_book = BookOf(in, books);
+        if (order_book != nullptr) {
+            held.push_back(order_book);
+        }
+    }
+    std::sort(held.begin(), held.end());
+    held.erase(std::unique(held.begin(), held.end()), held.end());
+}
+
+void Engine::ProcessFrame(Session &session, const std::vector<input> &frame, BookCache &books,
+                          std::vector<OrderBook*> &snapshots) {
+#ifdef ENGINE_TRACE
+    for (auto &in : frame) {
+        TRACE_POINT(in.order_id, Read);
+    }
+#endif
+
+    // the market data updates point to levels, which must outlive the flush.
+    // With the executor, Dispatch may wait for the session's mailboxes, which
+    // no thread may do inside a guard: it would hold back reclamation for the
+    // whole engine. Dispatch guards what it handles itself instead.
+    std::optional<Epoch::Guard> guard;
+    if (executor == nullptr) {
+        guard.emplace();
+    }
+    for (auto &in : frame) {
+        OrderBook *order_book = executor != nullptr ? Dispatch(session, in, books) : ProcessInput(session, in, books);
+        if (order_book != nullptr && marketData.SnapshotDue(*order_book)) {
+            snapshots.push_back(order_book);
+        }
+    }
+    if (!guard.has_value()) {
+        guard.emplace();
+    }
+
+    // depth updates are coalesced over the whole frame, and output lines
+    // written out together
+    marketData.Flush();
+    OutputWriter::Flush();
+    for (OrderBook *order_book : snapshots) {
+        marketData.Snapshot(*order_book);
+    }
+    snapshots.clear();
+}
+
+OrderBook *Engine::Dispatch(Session &session, const input &input, BookCache &books) {
+    // a session's inputs take effect in the order it sent them: an input
+    // follows the session's earlier ones into their book's mailbox, or waits
+    // until they are handled if it goes anywhere else
+    OrderBook *order_book = nullptr;
+    switch (input.type) {
+        case input_buy:
+        case input_sell:
+            order_book = GetOrderBook(input.instrument, books);
+            break;
+        case input_cancel:
+        case input_amend: {
+            // the order may still be in a mailbox, not in the order table yet
+            Settle(session);
+            Epoch::Guard guard;
+            Order *order;
+            if (Engine::orders.get(input.order_id, order)) {
+                order_book = GetOrderBook(order->instrument, books);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    if (order_book == nullptr) {
+        Settle(session);
+        // its depth updates are flushed before the guard ends, the frame's
+        // flush comes too late for the levels they point to
+        Epoch::Guard guard;
+        OrderBook *handled = ProcessInput(session, input, books);
+        marketData.Flush();
+        return handled;
+    }
+    if (session.pending_book != order_book) {
+        Settle(session);
+        session.pending_book = order_book;
+    }
+    session.pending.fetch_add(1);
+
+    bool queued;
+    {
+        std::lock_guard<std::mutex> lock{order_book->mailbox_m};
+        order_book->mailbox.push_back(Mail{input, &session});
+        queued = order_book->scheduled;
+        order_book->scheduled = true;
+    }
+    if (!queued) {
+        executor->Schedule(order_book);
+    }
+    return nullptr;
+}
+
+void Engine::RunBook(OrderBook *order_book) {
+    // the mailbox is emptied in turns, so a busy book lets the others in
+    static thread_local std::vector<Mail> mail;
+    static thread_local BookCache books;
+    {
+        std::lock_guard<std::mutex> lock{order_book->mailbox_m};
+        mail.swap(order_book->mailbox);
+    }
+    {
+        Epoch::Guard guard;
+        bool snapshot = false;
+        for (const Mail &m : mail) {
+            ProcessInput(*m.session, m.in, books);
+            snapshot |= marketData.SnapshotDue(*order_book);
+            if (m.session->pending.fetch_sub(1) == 1) {
+                m.session->pending.notify_all();
+            }
+        }
+        marketData.Flush();
+        OutputWriter::Flush();
+        if (snapshot) {
+            marketData.Snapshot(*order_book);
+        }
+    }
+    mail.clear();
+
+    {
+        std::lock_guard<std::mutex> lock{order_book->mailbox_m};
+        if (order_book->mailbox.empty()) {
+            order_book->scheduled = false;
+            return;
+        }
+    }
+    executor->Schedule(order_book);
+}
+
+void Engine::Settle(Session &session) {
+    for (uint32_t pending; (pending = session.pending.load()) != 0;) {
+        session.pending.wait(pending);
+    }
+}
+
+void Engine::Disconnect(Session &session) {
+    Settle(session);
+    if (cancelOnDisconnect) {
+        Epoch::Guard guard;
+        MassCancel(session, CurrentTimestamp());
+        marketData.Flush();
+        OutputWriter::Flush();
+    }
+    Stats::Count(Stats::Connections, -1);
+}
+
+OrderBook *Engine::GetOrderBook(const std::string &instrument, BookCache &books) {
+    auto cached = books.find(instrument);
+    if (cached != books.end()) {
+        return cached->second;
+    }
+
+    OrderBook *order_book;
+    if (!orderBooks.get(instrument, order_book)) {
+        OrderBook *created = new OrderBook{instrument};
+        if (orderBooks.put(instrument, created)) {
+            order_book = created;
+            std::lock_guard<std::mutex> lock{allBooksM};
+            allBooks.push_back(order_book);
+        } else {
+            // another connection made the book first
+            delete created;
+            orderBooks.get(instrument, order_book);
+        }
+    }
+    books.emplace(instrument, order_book);
+    return order_book;
+}
+
+// Returns the book the input went to, if any.
+OrderBook *Engine::ProcessInput(Session &session, const input &input, BookCache &books) {
+    int64_t input_time = CurrentTimestamp();
+    bool timed = Stats::Sampled();
+    Stats::Count(Stats::Inputs);
+    TRACE_POINT(input.order_id, Dispatch);
+    switch (input.type) {
+        case input_cancel:
+//            std::cout << "Got cancel: ID: " << input.order_id << std::endl;
+//            Output::OrderDeleted(input.order_id, true, input_time,
+//                                 CurrentTimestamp());
+            break;
+        default:
+//            std::cout << "Got order: " << static_cast<char>(input.type) << " "
+//                      << input.instrument << " x " << input.count << " @ "
+//                      << input.price << " ID: " << input.order_id
+//                      << std::endl;
+            break;
+    }
+
+    // executing orders
+    auto newOrder = [&]() {
+        return new Order{
+            .order_id = input.order_id, .price = input.price, .count = input.count, .execution_id = 1,
+            .input_time = input_time, .sequence = 0, .type = input.type, .node = nullptr, .session_prev = nullptr,
+            .session_next = nullptr, .session = &session, .instrument = input.instrument};
+    };
+    OrderBook *order_book = nullptr;
+    switch (input.type) {
+        case input_buy: {
+            Stats::Count(Stats::Orders);
+            Order *order = newOrder();
+            order_book = GetOrderBook(order->instrument, books);
+            if (order_book->batched) {
+                order_book->queueOrder(order);
                 break;
             }
-            case input_sell: {
-                OrderBook *order_book;
-                if (!orderBooks.get(order->instrument, order_book)) {
-                    orderBooks.put(order->instrument, new OrderBook{order->instrument});
-                    orderBooks.get(order->instrument, order_book);
-                }
-                order_book->processSellOrder(order);
+            // an order that does not rest was never seen by another thread
+            if (!order_book->processBuyOrder(order)) {
+                delete order;
+            }
+            break;
+        }
+        case input_sell: {
+            Stats::Count(Stats::Orders);
+            Order *order = newOrder();
+            order_book = GetOrderBook(order->instrument, books);
+            if (order_book->batched) {
+                order_book->queueOrder(order);
                 break;
             }
-            case input_cancel: {
-                std::shared_ptr<Order> orderToCancel;
-                if (!Engine::orders.get(input.order_id, orderToCancel)) {
-                    Output::OrderDeleted(input.order_id, false, input_time, CurrentTimestamp());
-                    break;
-                }
-                OrderBook *order_book;
-                orderBooks.get(orderToCancel->instrument, order_book);
-                order_book->processCancelOrder(orderToCancel);
+            if (!order_book->processSellOrder(order)) {
+                delete order;
+            }
+            break;
+        }
+        case input_cancel: {
+            Stats::Count(Stats::Cancels);
+            Order *orderToCancel;
+            if (!Engine::orders.get(input.order_id, orderToCancel)) {
+                Output::OrderDeleted(input.order_id, false, input_time, CurrentTimestamp());
+                break;
+            }
+            order_book = GetOrderBook(orderToCancel->instrument, books);
+            if (order_book->batched) {
+                order_book->queueOrder(newOrder());
                 break;
             }
+            order_book->processCancelOrder(orderToCancel);
+            break;
         }
+        case input_amend: {
+            Stats::Count(Stats::Amends);
+            Order *orderToAmend;
+            if (input.count == 0 || !Engine::orders.get(input.order_id, orderToAmend)) {
+                Output::OrderAmended(input.order_id, false, input.price, input.count, input_time,
+                                     CurrentTimestamp());
+                break;
+            }
+            order_book = GetOrderBook(orderToAmend->instrument, books);
+            order_book->processAmendOrder(orderToAmend, input.price, input.count, input_time);
+            break;
+        }
+        case input_mass_cancel:
+            Stats::Count(Stats::MassCancels);
+            MassCancel(session, input_time);
+            break;
+        case input_depth:
+            Stats::Count(Stats::DepthQueries);
+            ReportDepth(input, input_time);
+            break;
+        case input_batch:
+            // batch frames do not nest
+            std::cerr << "Nested batch frame ignored" << std::endl;
+            break;
     }
+    if (timed) {
+        Stats::Latency(CurrentTimestamp() - input_time);
+    }
+    TRACE_POINT(input.order_id, Done);
+    return order_book;
+}
 
+void Engine::ReportDepth(const input &input, int64_t input_time) {
+    // read without the book's locks (see OrderNode::view), so a query never
+    // holds up matching; a book that does not exist yet has two empty sides
+    static thread_local std::vector<LevelView> bids, asks;
+    bids.clear();
+    asks.clear();
+    OrderBook *order_book;
+    if (orderBooks.get(input.instrument, order_book)) {
+        order_book->buyBook.depth(input.count, bids);
+        order_book->sellBook.depth(input.count, asks);
+    }
+    Output::BookDepth(input.instrument, bids, asks, input_time, CurrentTimestamp());
 }
 
-void OrderBook::processSellOrder(std::shared_ptr<Order> order) {
-    m.lock();
+void Session::link(Order *order) {
+    std::lock_guard<std::mutex> lock{m};
+    order->session_prev = nullptr;
+    order->session_next = orders;
+    if (orders != nullptr) {
+        orders->session_prev = order;
+    }
+    orders = order;
+}
 
-    int v = order->count;
+void Session::unlink(Order *order) {
+    std::lock_guard<std::mutex> lock{m};
+    if (order->session_prev != nullptr) {
+        order->session_prev->session_next = order->session_next;
+    } else {
+        orders = order->session_next;
+    }
+    if (order->session_next != nullptr) {
+        order->session_next->session_prev = order->session_prev;
+    }
+    order->session_prev = nullptr;
+    order->session_next = nullptr;
+}
 
-    buyBook.head.m.lock();
-    OrderNode *curr = buyBook.head.next;
-    while (v > 0 && curr != nullptr) {
-        curr->m.lock();
-        if (curr->price < order->price) {
-            curr->m.unlock();
-            break;
+void Engine::MassCancel(Session &session, int64_t input_time) {
+    // the levels holding the session's orders, per instrument and side; a level
+    // reclaimed after the session lock is dropped is retired, not freed, so the
+    // pointers stay good while the caller is in its guard
+    std::map<std::string, std::pair<std::vector<OrderNode*>, std::vector<OrderNode*>>> levels;
+    {
+        std::lock_guard<std::mutex> lock{session.m};
+        for (Order *order = session.orders; order != nullptr; order = order->session_next) {
+            auto &sides = levels[order->instrument];
+            (order->type == input_sell ? sides.second : sides.first).push_back(order->node);
         }
-        v -= curr->volume;
-        curr = curr->next;
     }
 
-    if (v > 0) {
-        sellBook.head.m.lock();
+    for (auto &[instrument, sides] : levels) {
+        OrderBook *order_book;
+        if (!orderBooks.get(instrument, order_book)) {
+            continue;
+        }
+        order_book->cancelSessionOrders<BuySide>(session, std::move(sides.first), input_time);
+        order_book->cancelSessionOrders<SellSide>(session, std::move(sides.second), input_time);
+    }
+    for (OrderBook *order_book : auctionBooks) {
+        order_book->cancelQueuedOrders(session, input_time);
     }
+}
 
-    m.unlock();
-    buyBook.matchOrder(order);
-    if (order->count > 0) {
-        sellBook.add(order);
+template <typename Side>
+void OrderBook::cancelSessionOrders(Session &session, std::vector<OrderNode*> levels, int64_t input_time) {
+    if (levels.empty()) {
+        return;
+    }
+
+    // take the levels in list order, the same order every traversal uses
+    std::sort(levels.begin(), levels.end(), [](OrderNode *a, OrderNode *b) {
+        return Side::before(a->price, b->price);
+    });
+    levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+
+    OrderNode *head = &side<Side>().head;
+    head->m.lock();
+    for (OrderNode *level : levels) {
+        level->m.lock();
+    }
+    head->m.unlock();
+
+    for (OrderNode *level : levels) {
+        level->beginWrite();
+        uint32_t volume = level->volume;
+        for (auto it = level->orders.begin(); it != level->orders.end();) {
+            Order *order = *it;
+            if (order->session != &session || order->count == 0) {
+                ++it;
+                continue;
+            }
+            level->volume -= order->count;
+            session.unlink(order);
+            Engine::orders.remove(order->order_id);
+            Output::OrderDeleted(order->order_id, true, input_time, CurrentTimestamp());
+            it = level->orders.erase(it);
+            Epoch::retire(order);
+        }
+        if (level->volume != volume) {
+            side<Side>().index.addVolume(level->price, int64_t{level->volume} - volume);
+            side<Side>().compact(level);
+            Engine::marketData.LevelChanged(instrument, level, Side::is_sell_side);
+        }
+        level->endWrite();
+        level->m.unlock();
     }
 }
 
-void OrderBook::processBuyOrder(std::shared_ptr<Order> order) {
+template <typename Side>
+bool OrderBook::processOrder(Order *order) {
+    using Opposite = typename Side::opposite;
+    BookSide<Side> &own = side<Side>();
+    BookSide<Opposite> &opposite = side<Opposite>();
+
+    // levels the order will sweep, reused across inputs of this thread
+    static thread_local std::vector<OrderNode*> levels;
+    levels.clear();
+
+    TRACE_POINT(order->order_id, Lock);
     m.lock();
     int v = order->count;
 
-    sellBook.head.m.lock();
-    OrderNode *curr = sellBook.head.next;
-    while (v > 0 && curr != nullptr) {
+    // the liquidity index tells how far the order sweeps, and the levels up to
+    // there come out of it in one pass rather than one lookup each
+    opposite.head.m.lock();
+    opposite.reclaim();
+    OrderNode *last = opposite.reach(order->count);
+    bool short_of_limit = last != nullptr && Opposite::crosses(last->price, order->price);
+    opposite.collect(short_of_limit ? last->price : order->price, levels);
+    for (OrderNode *curr : levels) {
         curr->m.lock();
-        if (curr->price > order->price) {
-            curr->m.unlock();
-            break;
-        }
         v -= curr->volume;
-        curr = curr->next;
+    }
+    // the index may be behind a cancel or a fill in flight on another thread,
+    // so the volume actually locked decides
+    if (v > 0 && short_of_limit) {
+        OrderNode *curr = levels.empty() ? opposite.best() : opposite.after(levels.back());
+        for (; v > 0 && curr != nullptr; curr = opposite.after(curr)) {
+            if (!Opposite::crosses(curr->price, order->price)) {
+                break;
+            }
+            curr->m.lock();
+            v -= curr->volume;
+            levels.push_back(curr);
+        }
     }
     if (v > 0) {
-        buyBook.head.m.lock();
+        own.head.m.lock();
     }
 
     m.unlock();
-    sellBook.matchOrder(order);
-    if (order->count > 0) {
-        buyBook.add(order);
+    TRACE_POINT(order->order_id, Match);
+    opposite.matchOrder(order, levels);
+    if (order->count == 0) {
+        return false;
     }
+    own.add(order);
+    return true;
 }
 
-void OrderBook::processCancelOrder(std::shared_ptr<Order> order) {
-    OrderNode *head = order->type == input_buy ? &buyBook.head : &sellBook.head;
-    head->m.lock();
-    OrderNode *curr = head->next;
-    if (curr != nullptr) {
-        curr->m.lock();
+bool OrderBook::processSellOrder(Order *order) {
+    return processOrder<SellSide>(order);
+}
+
+bool OrderBook::processBuyOrder(Order *order) {
+    return processOrder<BuySide>(order);
+}
+
+void OrderBook::processCancelOrder(Order *order) {
+    if (order->type == input_sell) {
+        cancelOrder<SellSide>(order);
+    } else {
+        cancelOrder<BuySide>(order);
     }
-    head->m.unlock();
+}
 
-    //hand overhand
-    while (curr != nullptr && curr->price != order->price) {
-        OrderNode *next = curr->next;
-        if (next == nullptr) {
-            curr->m.unlock();
-            curr = next;
+template <typename Side>
+void OrderBook::cancelOrder(Order *order) {
+    // the order knows its level; it is cancelled in place, without looking for
+    // it in the queue, and left for matching or compaction to drop
+    OrderNode *level = order->node;
+    while (level != nullptr) {
+        level->m.lock();
+        if (order->node == level) {
             break;
-        };
-        next->m.lock();
-        curr->m.unlock();
-        curr = next;
+        }
+        // moved to another level by an amend in the meantime
+        level->m.unlock();
+        level = order->node;
     }
 
-    if (curr == nullptr) {
+    if (level == nullptr || order->count == 0) {
+        if (level != nullptr) {
+            level->m.unlock();
+        }
         Output::OrderDeleted(order->order_id, false, order->input_time, CurrentTimestamp());
         return;
     }
 
-    if (curr->price == order->price) {
-        auto it = curr->orders.begin();
-        for (; it != curr->orders.end(); ++it) {
-            if ((*it)->order_id == order->order_id) {
-                break;
-            }
-        }
+    level->beginWrite();
+    level->volume -= order->count;
+    side<Side>().index.addVolume(level->price, -int64_t{order->count});
+    order->count = 0;
+    level->tombstones++;
+    Engine::marketData.LevelChanged(order->instrument, level, Side::is_sell_side);
 
-        if (it == curr->orders.end()) {
-            curr->m.unlock();
-            Output::OrderDeleted(order->order_id, false, order->input_time, CurrentTimestamp());
-            return;
-        }
+    order->session->unlink(order);
+    Engine::orders.remove(order->order_id);
+    Output::OrderDeleted(order->order_id, true, order->input_time, CurrentTimestamp());
+    side<Side>().compact(level);
+    level->endWrite();
+    level->m.unlock();
+}
 
-        curr->volume -= order->count;
+void OrderBook::queueOrder(Order *order) {
+    // queued orders can be cancelled before the auction, so they are known by id already
+    if (order->type != input_cancel) {
+        Engine::orders.put(order->order_id, order);
+    }
+    std::lock_guard<std::mutex> lock{batch_m};
+    order->sequence = sequence.fetch_add(1, std::memory_order_relaxed);
+    batch.push_back(order);
+    if (order->type != input_cancel) {
+        batchOrders.emplace(order->order_id, order);
+    }
+}
 
-        curr->orders.erase(it);
-        Engine::orders.remove(order->order_id);
-        Output::OrderDeleted(order->order_id, true, order->input_time, CurrentTimestamp());
+void OrderBook::cancelQueuedOrders(Session &session, int64_t input_time) {
+    std::lock_guard<std::mutex> lock{batch_m};
+    for (Order *order : batch) {
+        if (order->type != input_cancel && order->session == &session && order->count > 0) {
+            // the auction skips orders with nothing left
+            order->count = 0;
+            Engine::orders.remove(order->order_id);
+            Output::OrderDeleted(order->order_id, true, input_time, CurrentTimestamp());
+        }
     }
-    curr->m.unlock();
 }
 
-void BuyBook::add(std::shared_ptr<Order> order) {
-    OrderNode *curr = &head;
-    OrderNode *next = curr->next;
+namespace {
+// an order taking part in an auction, node is null for orders from the batch
+struct AuctionEntry {
+    Order *order;
+    OrderNode *node;
+};
+}
 
-    // during condition check, holding current & next lock
-    // after while loop, only lock the node that we wish to modify( ie. modify orders or update next to new node)
-    while (next != nullptr) {
-        next->m.lock();
-        if (order->price > next->price) {
-            next->m.unlock();
-            break;
+void OrderBook::runAuction() {
+    std::vector<Order*> pending;
+    std::unordered_map<uint32_t, Order*> byId;
+    {
+        std::lock_guard<std::mutex> lock{batch_m};
+        pending.swap(batch);
+        byId.swap(batchOrders);
+    }
+    if (pending.empty()) {
+        return;
+    }
+
+    // cancels first: queued orders leave the batch, resting ones go through the book
+    for (Order *cancel : pending) {
+        if (cancel->type != input_cancel) {
+            continue;
         }
-        if (order->price == next->price) {
-            curr->m.unlock();
-            curr = next;
-            break;
+        auto it = byId.find(cancel->order_id);
+        if (it != byId.end() && it->second->count > 0) {
+            it->second->count = 0;
+            Engine::orders.remove(cancel->order_id);
+            Output::OrderDeleted(cancel->order_id, true, cancel->input_time, CurrentTimestamp());
+            continue;
         }
-
-        curr->m.unlock();
-        curr = next;
-        next = curr->next;
+        Order *resting;
+        if (!Engine::orders.get(cancel->order_id, resting)) {
+            Output::OrderDeleted(cancel->order_id, false, cancel->input_time, CurrentTimestamp());
+            continue;
+        }
+        processCancelOrder(resting);
     }
 
-    // case 1: current price != order price
-    // case 2: current price == order price
+    m.lock();
+    buyBook.head.m.lock();
+    sellBook.head.m.lock();
+    m.unlock();
+    buyBook.reclaim();
+    sellBook.reclaim();
 
-    if (order->price != curr->price) {
-        OrderNode *newNode = new OrderNode{order->price};
-        newNode->m.lock();
-        newNode->next = curr->next;
-        curr->next = newNode;
-        curr->m.unlock();
+    // lock every level, nothing else moves in this book until the auction is done
+    std::vector<OrderNode*> levels;
+    for (OrderNode *curr = buyBook.best(); curr != nullptr; curr = buyBook.after(curr)) {
+        curr->m.lock();
+        curr->beginWrite();
+        levels.push_back(curr);
+    }
+    size_t buyLevels = levels.size();
+    for (OrderNode *curr = sellBook.best(); curr != nullptr; curr = sellBook.after(curr)) {
+        curr->m.lock();
+        curr->beginWrite();
+        levels.push_back(curr);
+    }
 
-        curr = newNode;
+    // the batch joins the book now, in arrival order and with its whole count,
+    // so every order an execution names has been output before, whichever
+    // side it is on; what is left of it rests without being output again
+    for (Order *order : pending) {
+        if (order->type != input_cancel && order->count > 0) {
+            Output::OrderAdded(order->order_id, instrument.c_str(), order->price, order->count,
+                               order->type == input_sell, order->input_time, CurrentTimestamp());
+        }
     }
 
-    auto it = curr->orders.begin();
-    for (; it != curr->orders.end() ; ++it) {
-        if (order->input_time > (*it)->input_time) {
-            break;
+    // demand[i] is the volume bid at prices[i] or higher, supply[i] the volume offered
+    // at prices[i] or lower; the clearing price executes the most volume, ties going
+    // to the smallest imbalance
+    std::vector<uint32_t> prices;
+    for (OrderNode *level : levels) {
+        prices.push_back(level->price);
+    }
+    for (auto &order : pending) {
+        if (order->type != input_cancel && order->count > 0) {
+            prices.push_back(order->price);
         }
     }
-    curr->volume += order->count;
+    std::sort(prices.begin(), prices.end());
+    prices.erase(std::unique(prices.begin(), prices.end()), prices.end());
+    auto index = [&](uint32_t price) {
+        return std::lower_bound(prices.begin(), prices.end(), price) - prices.begin();
+    };
 
-    Engine::orders.put(order->order_id, order);
-    curr->orders.insert(it, order);
-    Output::OrderAdded(order->order_id, order->instrument.c_str(), order->price, order->count,
-                       false, order->input_time, CurrentTimestamp());
+    size_t n = prices.size();
+    std::vector<uint64_t> demand(n), supply(n);
+    for (size_t i = 0; i < levels.size(); i++) {
+        (i < buyLevels ? demand : supply)[index(levels[i]->price)] += levels[i]->volume;
+    }
+    for (auto &order : pending) {
+        if (order->type == input_buy) {
+            demand[index(order->price)] += order->count;
+        } else if (order->type == input_sell) {
+            supply[index(order->price)] += order->count;
+        }
+    }
+    for (size_t i = n - 1; i-- > 0;) {
+        demand[i] += demand[i + 1];
+    }
+    for (size_t i = 1; i < n; i++) {
+        supply[i] += supply[i - 1];
+    }
 
-    curr->m.unlock();
+    uint64_t volume = 0;
+    uint64_t imbalance = 0;
+    uint32_t clearingPrice = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t executable = std::min(demand[i], supply[i]);
+        uint64_t diff = std::max(demand[i], supply[i]) - executable;
+        if (executable > volume || (executable == volume && executable > 0 && diff < imbalance)) {
+            volume = executable;
+            imbalance = diff;
+            clearingPrice = prices[i];
+        }
+    }
 
-}
+    if (volume > 0) {
+        std::vector<AuctionEntry> bids, asks;
+        std::vector<uint32_t> volumes;
+        for (size_t i = 0; i < levels.size(); i++) {
+            OrderNode *level = levels[i];
+            volumes.push_back(level->volume);
+            bool eligible = i < buyLevels ? level->price >= clearingPrice : level->price <= clearingPrice;
+            if (!eligible) {
+                continue;
+            }
+            for (Order *order : level->orders) {
+                if (order->count > 0) {
+                    (i < buyLevels ? bids : asks).push_back(AuctionEntry{order, level});
+                }
+            }
+        }
+        for (auto &order : pending) {
+            if (order->count == 0) {
+                continue;
+            }
+            if (order->type == input_buy && order->price >= clearingPrice) {
+                bids.push_back(AuctionEntry{order, nullptr});
+            } else if (order->type == input_sell && order->price <= clearingPrice) {
+                asks.push_back(AuctionEntry{order, nullptr});
+            }
+        }
+        // at one price, resting orders keep their queue order ahead of the batch,
+        // which is in arrival order
+        std::stable_sort(bids.begin(), bids.end(), [](const AuctionEntry &a, const AuctionEntry &b) {
+            return a.order->price > b.order->price;
+        });
+        std::stable_sort(asks.begin(), asks.end(), [](const AuctionEntry &a, const AuctionEntry &b) {
+            return a.order->price < b.order->price;
+        });
 
-void BuyBook::matchOrder(std::shared_ptr<Order> order) {
+        size_t b = 0;
+        size_t a = 0;
+        while (volume > 0) {
+            AuctionEntry &bid = bids[b];
+            AuctionEntry &ask = asks[a];
+            uint32_t count = static_cast<uint32_t>(std::min<uint64_t>({bid.order->count, ask.order->count, volume}));
 
-    OrderNode *curr = &head;
-    OrderNode *next = curr->next;
-    curr->m.unlock();
-    curr = next;
-    while (order->count > 0 && curr != nullptr && curr->price >= order->price){
-        int numPopback = 0;
+            // the resting side is the one already on the book, or the older of two new orders
+            bool bidRests = bid.node != nullptr ||
+                            (ask.node == nullptr && bid.order->sequence < ask.order->sequence);
+            Order &resting = bidRests ? *bid.order : *ask.order;
+            Order &incoming = bidRests ? *ask.order : *bid.order;
+            Stats::Count(Stats::Executions);
+            Output::OrderExecuted(resting.order_id, incoming.order_id, resting.execution_id++, clearingPrice,
+                                  count, incoming.input_time, CurrentTimestamp());
 
-        for (auto it = curr->orders.rbegin(); it != curr->orders.rend(); ++it) {
-            if (order->count == 0) break;
-            uint32_t count_matched;
-            uint32_t resting_id = (*it)->order_id;
-            uint32_t matched_price = (*it)->price;
-            uint32_t current_exec_id = (*it)->execution_id;
-
-            if (order->count >= (*it)->count) {
-                count_matched = (*it)->count;
-                order->count -= (*it)->count;
-                numPopback++;
-                Engine::orders.remove(order->order_id);
-            } else {
-                count_matched = order->count;
-                (*it)->count -= order->count;
-                (*it)->execution_id += 1;
-                order->count = 0;
+            volume -= count;
+            for (AuctionEntry *entry : {&bid, &ask}) {
+                entry->order->count -= count;
+                if (entry->node != nullptr) {
+                    entry->node->volume -= count;
+                }
+                if (entry->order->count == 0) {
+                    Engine::orders.remove(entry->order->order_id);
+                    if (entry->node != nullptr) {
+                        entry->order->session->unlink(entry->order);
+                    }
+                }
             }
-            curr->volume -= count_matched;
+            b += bid.order->count == 0;
+            a += ask.order->count == 0;
+        }
 
-            Output::OrderExecuted(resting_id, order->order_id, current_exec_id, matched_price,
-                                  count_matched, order->input_time, CurrentTimestamp());
+        for (size_t i = 0; i < levels.size(); i++) {
+            OrderNode *level = levels[i];
+            if (level->volume != volumes[i]) {
+                (i < buyLevels ? buyBook.index : sellBook.index)
+                    .addVolume(level->price, int64_t{level->volume} - volumes[i]);
+                for (Order *order : level->orders) {
+                    if (order->count == 0) {
+                        Epoch::retire(order);
+                    }
+                }
+                // cancelled orders go too
+                std::erase_if(level->orders, [](const Order *order) { return order->count == 0; });
+                level->tombstones = 0;
+                level->front = 0;
+                if (i < buyLevels) {
+                    buyBook.compact(level);
+                } else {
+                    sellBook.compact(level);
+                }
+                Engine::marketData.LevelChanged(instrument, level, i >= buyLevels);
+            }
+        }
+    }
+
+    for (OrderNode *level : levels) {
+        level->endWrite();
+        level->m.unlock();
+    }
+    buyBook.head.m.unlock();
+    sellBook.head.m.unlock();
 
+    // whatever is left of the batch rests on the book, in arrival order; cancels
+    // and orders with nothing left go, the latter may still be looked up by id
+    for (Order *order : pending) {
+        if (order->type == input_cancel) {
+            delete order;
+        } else if (order->count == 0) {
+            Epoch::retire(order);
+        } else if (order->type == input_buy) {
+            buyBook.head.m.lock();
+            buyBook.add(order, true);
+        } else if (order->type == input_sell) {
+            sellBook.head.m.lock();
+            sellBook.add(order, true);
         }
+    }
+}
 
-        for (int i = 0; i < numPopback; i++) {
-            curr->orders.pop_back();
+void OrderBook::processAmendOrder(Order *order, uint32_t price, uint32_t count,
+                                  int64_t input_time) {
+    OrderNode *level = order->node;
+    if (level == nullptr) {
+        // not on the book, only an order waiting for an auction can still be amended
+        bool queued = false;
+        if (batched) {
+            std::lock_guard<std::mutex> lock{batch_m};
+            auto it = batchOrders.find(order->order_id);
+            queued = it != batchOrders.end() && it->second == order && order->count > 0;
+            if (queued) {
+                order->price = price;
+                order->count = count;
+                order->input_time = input_time;
+            }
         }
-        next = curr->next;
-        curr->m.unlock();
-        curr = next;
+        Output::OrderAmended(order->order_id, queued, price, count, input_time, CurrentTimestamp());
+        return;
+    }
+
+    // the order knows its level, so there is no need to walk the book to it
+    level->m.lock();
+    if (order->node != level || order->count == 0) {
+        // filled, cancelled or moved since it was looked up
+        level->m.unlock();
+        Output::OrderAmended(order->order_id, false, price, count, input_time, CurrentTimestamp());
+        return;
+    }
+    auto it = std::find(level->orders.begin(), level->orders.end(), order);
+
+    bool is_sell_side = order->type == input_sell;
+    if (price == order->price) {
+        // same level: going down keeps the queue position, going up goes to the back
+        level->beginWrite();
+        level->volume = level->volume - order->count + count;
+        (is_sell_side ? sellBook.index : buyBook.index)
+            .addVolume(price, int64_t{count} - order->count);
+        if (count > order->count) {
+            level->orders.erase(it);
+            level->orders.push_back(order);
+            order->input_time = input_time;
+            order->sequence = sequence.fetch_add(1, std::memory_order_relaxed);
+        }
+        order->count = count;
+        Engine::marketData.LevelChanged(instrument, level, is_sell_side);
+        level->endWrite();
+        Output::OrderAmended(order->order_id, true, price, count, input_time, CurrentTimestamp());
+        level->m.unlock();
+        return;
+    }
+
+    // new price: off this level, then in again like a new order, matching included
+    level->beginWrite();
+    level->volume -= order->count;
+    (is_sell_side ? sellBook.index : buyBook.index).addVolume(level->price, -int64_t{order->count});
+    Engine::marketData.LevelChanged(instrument, level, is_sell_side);
+    order->session->unlink(order);
+    level->orders.erase(it);
+    if (is_sell_side) {
+        sellBook.compact(level);
+    } else {
+        buyBook.compact(level);
+    }
+    level->endWrite();
+    order->node = nullptr;
+    order->price = price;
+    order->count = count;
+    order->input_time = input_time;
+    Output::OrderAmended(order->order_id, true, price, count, input_time, CurrentTimestamp());
+    level->m.unlock();
+
+    if (batched) {
+        queueOrder(order);
+        return;
+    }
+    bool rests = is_sell_side ? processSellOrder(order) : processBuyOrder(order);
+    if (!rests) {
+        // others may have looked it up by id while it was off the book
+        Engine::orders.remove(order->order_id);
+        Epoch::retire(order);
     }
 }
 
-void SellBook::matchOrder(std::shared_ptr<Order> order) {
-    // move out of head
-    OrderNode *curr = &head;
-    OrderNode *next = curr->next;
+template <typename Side>
+void BookSide<Side>::add(Order *order, bool announced) {
+    // the caller holds head.m, under which the index finds or makes the level
+    TRACE_POINT(order->order_id, Add);
+    reclaim();
+    OrderNode *curr = index.findOrCreate(order->price);
+    curr->m.lock();
+    index.markOccupied(order->price);
+    head.m.unlock();
+
+    curr->beginWrite();
+    curr->volume += order->count;
+    index.addVolume(order->price, order->count);
+    Engine::marketData.LevelChanged(order->instrument, curr, Side::is_sell_side);
+
+    Engine::orders.put(order->order_id, order);
+    order->node = curr;
+    order->session->link(order);
+    order->sequence = sequence.fetch_add(1, std::memory_order_relaxed);
+    curr->orders.push_back(order);
+    curr->endWrite();
+    if (!announced) {
+        Output::OrderAdded(order->order_id, order->instrument.c_str(), order->price, order->count,
+                           Side::is_sell_side, order->input_time, CurrentTimestamp());
+    }
+
     curr->m.unlock();
-    curr = next;
 
-    while (order->count > 0 && curr != nullptr && curr->price <= order->price) {
-        int numPopback = 0;
-        for (auto it = curr->orders.rbegin(); it != curr->orders.rend(); ++it) {
-            if (order->count == 0) break;
+}
+
+template <typename Side>
+void BookSide<Side>::matchOrder(Order *order, const std::vector<OrderNode*> &levels) {
+    head.m.unlock();
+    for (OrderNode *curr : levels) {
+        if (order->count == 0) {
+            curr->m.unlock();
+            continue;
+        }
+        curr->beginWrite();
+        uint32_t volume = curr->volume;
+        std::vector<Order*> &queue = curr->orders;
 
+        for (size_t i = curr->front; i < queue.size() && order->count > 0; i++) {
+            Order *resting = queue[i];
+            if (resting->count == 0) {
+                // cancelled
+                continue;
+            }
             uint32_t count_matched;
-            uint32_t resting_id = (*it)->order_id;
-            uint32_t matched_price = (*it)->price;
-            uint32_t current_exec_id = (*it)->execution_id;
-
-            if (order->count >= (*it)->count) {
-                count_matched = (*it)->count;
-                order->count -= (*it)->count;
-                numPopback++;
-                Engine::orders.remove(order->order_id);
+            uint32_t resting_id = resting->order_id;
+            uint32_t matched_price = resting->price;
+            uint32_t current_exec_id = resting->execution_id;
+
+            if (order->count >= resting->count) {
+                count_matched = resting->count;
+                order->count -= resting->count;
+                resting->count = 0;
+                curr->tombstones++;
+                Engine::orders.remove(resting_id);
+                resting->session->unlink(resting);
             } else {
                 count_matched = order->count;
-                (*it)->count -= order->count;
-                (*it)->execution_id += 1;
+                resting->count -= order->count;
+                resting->execution_id += 1;
                 order->count = 0;
             }
             curr->volume -= count_matched;
 
+            Stats::Count(Stats::Executions);
             Output::OrderExecuted(resting_id, order->order_id, current_exec_id, matched_price,
                                   count_matched, order->input_time, CurrentTimestamp());
 
         }
 
-        for (int i = 0; i < numPopback; i++) {
-            curr->orders.pop_back();
+        // the next sweep starts past what this one used up
+        while (curr->front < queue.size() && queue[curr->front]->count == 0) {
+            curr->front++;
+        }
+        index.addVolume(curr->price, int64_t{curr->volume} - volume);
+        compact(curr);
+        if (curr->volume != volume) {
+            Engine::marketData.LevelChanged(order->instrument, curr, Side::is_sell_side);
         }
-        next = curr->next;
+        curr->endWrite();
         curr->m.unlock();
-        curr = next;
     }
-
 }
 
-void SellBook::add(std::shared_ptr<Order> order) {
-
-    OrderNode *curr = &head;
-    OrderNode *next = curr->next;
+LevelView OrderNode::view() const {
+    // the fields are read while a writer may be changing them, and only kept
+    // if the version shows no write began or ended in between
+    while (true) {
+        uint32_t before = version.load(std::memory_order_acquire);
+        if ((before & 1) == 0) {
+            LevelView view{price, volume, resting, md_seq};
+            // the reads above may not move past the second load of version
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (version.load(std::memory_order_relaxed) == before) {
+                return view;
+            }
+        }
+        std::this_thread::yield();
+    }
+}
 
-    // during condition check, holding current & next lock
-    // after while loop, only lock the node that we wish to modify( ie. modify orders or update next to new node)
-    while (next != nullptr) {
-        next->m.lock();
-        if (order->price < next->price) {
-            next->m.unlock();
-            break;
+template <typename Side>
+void BookSide<Side>::depth(size_t n, std::vector<LevelView> &out) {
+    // levels marked occupied may have emptied since, so the index is scanned
+    // until n of them turn out to have orders
+    static thread_local std::vector<OrderNode*> levels;
+    out.clear();
+    uint32_t from = Side::is_sell_side ? 0 : UINT32_MAX;
+    while (out.size() < n) {
+        size_t wanted = n - out.size();
+        levels.clear();
+        index.scan(from, wanted, Side::is_sell_side, levels);
+        for (OrderNode *level : levels) {
+            LevelView view = level->view();
+            if (view.volume > 0) {
+                out.push_back(view);
+            }
         }
-        if (order->price == next->price) {
-            curr->m.unlock();
-            curr = next;
+        uint32_t last = levels.empty() ? from : levels.back()->price;
+        if (levels.size() < wanted || last == (Side::is_sell_side ? UINT32_MAX : 0)) {
             break;
         }
-
-        curr->m.unlock();
-        curr = next;
-        next = curr->next;
+        from = Side::is_sell_side ? last + 1 : last - 1;
     }
+}
 
-    // case 1: current price != order price
-    // case 2: current price == order price
-
-    if (order->price != curr->price) {
-        OrderNode *newNode = new OrderNode{order->price};
-        newNode->m.lock();
-        newNode->next = curr->next;
-        curr->next = newNode;
-        curr->m.unlock();
-
-        curr = newNode;
+template <typename Side>
+void BookSide<Side>::compact(OrderNode *level) {
+    // each compaction removes at least as many orders as it keeps, so the cost
+    // is spread over the fills and cancels that made the tombstones
+    if (2 * level->tombstones < level->orders.size()) {
+        return;
+    }
+    if (level->tombstones > 0) {
+        for (Order *order : level->orders) {
+            if (order->count == 0) {
+                Epoch::retire(order);
+            }
+        }
+        std::erase_if(level->orders, [](const Order *order) { return order->count == 0; });
+        level->tombstones = 0;
+        level->front = 0;
+    }
+    if (level->orders.empty()) {
+        release(level);
     }
+}
 
+template <typename Side>
+void BookSide<Side>::release(OrderNode *level) {
+    index.markEmpty(level->price);
+    if (level->released) {
+        return;
+    }
+    level->released = true;
+    level->next_released = released.load();
+    while (!released.compare_exchange_weak(level->next_released, level)) {
+    }
+}
 
-    auto it = begin(curr->orders);
-    for (; it != end(curr->orders); ++it) {
-        if (order->input_time > (*it)->input_time) {
-            break;
+template <typename Side>
+void BookSide<Side>::reclaim() {
+    if (released.load(std::memory_order_relaxed) == nullptr) {
+        return;
+    }
+    // nobody can find a level once it is out of the index, but an amend or a
+    // mass cancel may still hold it, hence the retire
+    OrderNode *level = released.exchange(nullptr);
+    while (level != nullptr) {
+        OrderNode *next = level->next_released;
+        if (!level->m.try_lock()) {
+            // in use; left for the next reclaim
+            level->next_released = released.load();
+            while (!released.compare_exchange_weak(level->next_released, level)) {
+            }
+        } else {
+            level->released = false;
+            bool empty = level->orders.empty();
+            if (empty) {
+                index.erase(level->price);
+            }
+            level->m.unlock();
+            if (empty) {
+                Epoch::retire(level);
+            }
         }
+        level = next;
     }
-    curr->volume += order->count;
-    Engine::orders.put(order->order_id, order);
-    curr->orders.insert(it, order);
-    Output::OrderAdded(order->order_id, order->instrument.c_str(), order->price, order->count,
-                       true, order->input_time, CurrentTimestamp());
-    curr->m.unlock();
-}
\ No newline at end of file
+}
+
+template struct BookSide<BuySide>;
+template struct BookSide<SellSide>;
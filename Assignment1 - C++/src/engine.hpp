@@ -4,70 +4,372 @@
 #ifndef ENGINE_HPP
 #define ENGINE_HPP
 
+#include <atomic>
 #include <chrono>
+#include <unordered_map>
 #include <vector>
 
 #include "io.h"
+#include "arena.hpp"
+#include "epoch.hpp"
+#include "executor.hpp"
 #include "hashmap.hpp"
+#include "marketdata.hpp"
+#include "ordertable.hpp"
+#include "priceindex.hpp"
+#include "reactor.hpp"
+#include "stats.hpp"
 
-struct Order {
-    enum input_type type;
+// Engine settings, read from the environment when the engine starts.
+struct EngineConfig {
+    // ENGINE_MD_PATH: file or fifo for the L2 market data feed, off if unset
+    std::string md_path;
+    // ENGINE_MD_SNAPSHOT_INTERVAL: snapshot a book every N inputs to it, 0 for never
+    uint32_t md_snapshot_interval;
+    // ENGINE_AUCTION_INSTRUMENTS: comma separated instruments matched in batch auctions
+    std::vector<std::string> auction_instruments;
+    // ENGINE_AUCTION_INTERVAL_MS: time between two auctions
+    uint32_t auction_interval_ms;
+    // ENGINE_CANCEL_ON_DISCONNECT: pull a connection's resting orders when it goes away
+    bool cancel_on_disconnect;
+    // ENGINE_ORDER_TABLE_IDS: order ids below this are indexed directly, 0 to hash them all
+    uint32_t order_table_ids;
+    // ENGINE_STATS_PATH: unix socket answering every connection with the engine's
+    // counters as JSON, off if unset
+    std::string stats_path;
+    // ENGINE_TRACE_PATH, ENGINE_TRACE_SAMPLE: where the order trace goes and which
+    // order ids it follows, one in N; only in builds with ENGINE_TRACE (trace.hpp)
+    std::string trace_path;
+    uint32_t trace_sample;
+    // ENGINE_REACTOR_THREADS: serve connections as coroutines on this many threads
+    // rather than a thread each, 0 for a thread each (reactor.hpp)
+    uint32_t reactor_threads;
+    // ENGINE_MATCHING_WORKERS: match books on this many workers, stealing books
+    // from each other, 0 to match on the connections' threads (executor.hpp);
+    // not with the reactor, whose threads must not wait for the workers
+    uint32_t matching_workers;
+    // ENGINE_ARENA_MB: size of the prefaulted arena orders, levels and books come
+    // from, 0 for the heap; with it the order table is prefaulted too (arena.hpp)
+    uint32_t arena_mb;
+
+    static EngineConfig FromEnvironment();
+};
+
+struct OrderNode;
+struct Session;
+class OrderBook;
+
+#define CACHE_LINE 64
+
+// The first cache line holds everything matching reads and writes; the
+// instrument and the session are only used when an order enters the book or
+// its owner disconnects.
+//
+// Orders are plain pointers passed between the id map, the levels and the
+// sessions. Once an order is off its level and out of the id map, whoever
+// took it out retires it (see epoch.hpp).
+struct alignas(CACHE_LINE) Order {
     uint32_t order_id;
     uint32_t price;
     uint32_t count;
-    std::string instrument;
-    int64_t input_time;
     uint32_t execution_id;
+    int64_t input_time;
+    uint64_t sequence;      // time priority, numbered by the book as the order queues
+    enum input_type type;
+    OrderNode *node;        // level the order rests on
+    Order *session_prev;    // links in session->orders
+    Order *session_next;
+
+    alignas(CACHE_LINE) Session *session;
+    std::string instrument;
+
+    ARENA_ALLOCATED
+};
+
+// A client connection and the orders it has resting on the books, kept in an
+// intrusive list so all of them can be pulled without searching the books.
+// Sessions live as long as the engine: orders still point to theirs after
+// the connection is gone.
+struct Session {
+    uint32_t id;
+    std::mutex m;
+    Order *orders;
+    // inputs left in a mailbox and not handled yet, all to one book (executor.hpp)
+    std::atomic<uint32_t> pending;
+    OrderBook *pending_book;
+
+    // called while holding the lock of the order's level
+    void link(Order *);
+    void unlink(Order *);
+
+    Session(uint32_t id): id{id}, m{}, orders{nullptr}, pending{0}, pending_book{nullptr} {}
 };
 
-struct OrderNode {
+// An input waiting in the mailbox of its book.
+struct Mail {
+    input in;
+    Session *session;
+};
+
+// A price level as a reader sees it without taking its lock.
+struct LevelView {
     uint32_t price;
     uint32_t volume;
-    std::vector<std::shared_ptr<Order>> orders;
-    OrderNode *next;
-    std::mutex m;
+    uint32_t orders; // neither filled nor cancelled
+    uint64_t md_seq;
+};
+
+// A field written only by the thread holding a lock and read without it
+// too: relaxed atomic loads and stores, so the lock-free readers do not race
+// with the writer. An update is a load and a store rather than an atomic
+// read-modify-write, there being one writer at a time.
+template <typename T>
+class Relaxed {
+    std::atomic<T> value;
+
+public:
+    Relaxed(T value): value{value} {}
+    Relaxed(const Relaxed &) = delete;
+    Relaxed &operator=(const Relaxed &) = delete;
 
-    OrderNode(): price{0}, volume{0}, orders{}, next{nullptr}, m{}{}
-    OrderNode(uint32_t price): price{price}, volume{0}, orders{}, next{nullptr}, m{} {}
+    operator T() const { return value.load(std::memory_order_relaxed); }
+    Relaxed &operator=(T v) {
+        value.store(v, std::memory_order_relaxed);
+        return *this;
+    }
+    Relaxed &operator+=(T v) { return *this = static_cast<T>(*this + v); }
+    Relaxed &operator-=(T v) { return *this = static_cast<T>(*this - v); }
+    Relaxed &operator++() { return *this += 1; }
+    T operator++(int) {
+        T before = *this;
+        *this = static_cast<T>(before + 1);
+        return before;
+    }
 };
 
-struct BuyBook {
-    OrderNode head;
-    void add(std::shared_ptr<Order>);
-    void matchOrder(std::shared_ptr<Order>);
+// A price level takes two whole cache lines: the data on the first, the lock
+// (and released, only used under it) on the second, so threads spinning on a lock or matching one level never
+// invalidate a neighbouring level or the price the prewalk reads unlocked.
+//
+// Orders queue oldest first: a new order is appended, matching starts at
+// front. A filled or cancelled order stays on its level with a count of 0
+// until the level is compacted. A level that runs out of orders is
+// released to its side and reclaimed by the next thread entering the side,
+// which drops it from the index and retires it.
+//
+// Readers that must not stall matching (depth queries, market data
+// snapshots) do not take m: version is a seqlock, odd while the thread
+// holding m changes anything view() reads, and a reader retries until it
+// sees the same even version before and after. What view() reads is
+// Relaxed; price is set before the level is published and never changes.
+struct alignas(CACHE_LINE) OrderNode {
+    uint32_t price;
+    Relaxed<uint32_t> volume;
+    std::vector<Order*> orders;
+    Relaxed<uint64_t> md_seq; // sequence number of the last depth update
+    OrderNode *next_released;
+    uint32_t tombstones; // filled or cancelled orders still in orders
+    uint32_t front;      // orders before it are all filled or cancelled
+    Relaxed<uint32_t> resting; // orders neither filled nor cancelled, as of endWrite
+    std::atomic<uint32_t> version;
 
-    BuyBook(): head{OrderNode{}}  {};
+    alignas(CACHE_LINE) std::mutex m;
+    bool released;  // waiting to be reclaimed, under m
+    uint32_t md_slot; // where the last thread to change it queued its depth update, under m
+
+    // around every change to volume, orders, tombstones or md_seq; under m
+    void beginWrite() {
+        version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+    void endWrite() {
+        resting = static_cast<uint32_t>(orders.size()) - tombstones;
+        version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    // without m, inside an epoch guard
+    LevelView view() const;
+
+    ARENA_ALLOCATED
+
+    OrderNode(): price{0}, volume{0}, orders{}, md_seq{0}, next_released{nullptr}, tombstones{0}, front{0},
+        resting{0}, version{0}, m{}, released{false}, md_slot{0} {}
+    OrderNode(uint32_t price): price{price}, volume{0}, orders{}, md_seq{0}, next_released{nullptr},
+        tombstones{0}, front{0}, resting{0}, version{0}, m{}, released{false}, md_slot{0} {}
 };
 
-struct SellBook {
+// Side traits: all that differs between the two sides of a book, known at
+// compile time so each side gets its own matching loops.
+struct SellSide;
+
+struct BuySide {
+    using opposite = SellSide;
+    static constexpr bool is_sell_side = false;
+    // a level at price a comes before one at price b, best bid first
+    static constexpr bool before(uint32_t a, uint32_t b) { return a > b; }
+    // a resting level at price can fill an incoming order limited at limit
+    static constexpr bool crosses(uint32_t price, uint32_t limit) { return price >= limit; }
+};
+
+struct SellSide {
+    using opposite = BuySide;
+    static constexpr bool is_sell_side = true;
+    static constexpr bool before(uint32_t a, uint32_t b) { return a < b; }
+    static constexpr bool crosses(uint32_t price, uint32_t limit) { return price <= limit; }
+};
+
+// A side of a book: head.m guards entry into the side and the price index of
+// its levels. Levels are found through the index, in price order, rather
+// than by walking them.
+template <typename Side>
+struct BookSide {
     OrderNode head;
-    void add(std::shared_ptr<Order>);
-    void matchOrder(std::shared_ptr<Order>);
+    PriceIndex index;
+    // levels that ran out of orders since the side was last reclaimed
+    std::atomic<OrderNode*> released;
+    // the book's sequence numbers, shared by both sides
+    std::atomic<uint64_t> &sequence;
+    // announced: its arrival was output already, by an auction
+    void add(Order *, bool announced = false);
+    // fills an incoming order of the opposite side against the given levels,
+    // locked in priority order by the caller
+    void matchOrder(Order *, const std::vector<OrderNode*> &levels);
+    // under the level's lock, after orders left it: drops the cancelled ones
+    // once they make up half the level, and releases the level if it is empty
+    void compact(OrderNode *level);
+    // under the level's lock, once its last order is gone
+    void release(OrderNode *level);
+    // drops the released levels that are still empty; under head.m
+    void reclaim();
 
-    SellBook(): head{OrderNode{}} {};
+    // best occupied level, and the next one behind a level; under head.m
+    OrderNode *best() {
+        if constexpr (Side::is_sell_side) {
+            return index.ascend(0);
+        } else {
+            return index.descend(UINT32_MAX);
+        }
+    }
+    OrderNode *after(const OrderNode *level) {
+        if constexpr (Side::is_sell_side) {
+            return level->price == UINT32_MAX ? nullptr : index.ascend(level->price + 1);
+        } else {
+            return level->price == 0 ? nullptr : index.descend(level->price - 1);
+        }
+    }
+    // level at which quantity is filled, null if the side cannot fill it, and the
+    // levels from the best through a price, by the liquidity index; under head.m
+    OrderNode *reach(uint64_t quantity) { return index.reach(quantity, Side::is_sell_side); }
+    void collect(uint32_t to, std::vector<OrderNode*> &out) { index.collect(to, Side::is_sell_side, out); }
+    // the first n levels with orders, best first, without any lock; inside an
+    // epoch guard. Each level is as it was at one point, not all at the same one.
+    void depth(size_t n, std::vector<LevelView> &out);
+
+    BookSide(std::atomic<uint64_t> &sequence): head{OrderNode{}}, index{}, released{nullptr},
+        sequence{sequence} {};
 };
 
+using BuyBook = BookSide<BuySide>;
+using SellBook = BookSide<SellSide>;
+
 class OrderBook {
 public:
-    void processSellOrder(std::shared_ptr<Order>);
-    void processBuyOrder(std::shared_ptr<Order>);
-    void processCancelOrder(std::shared_ptr<Order>);
+    // return whether the order rests on the book; if not, it is the caller's again
+    bool processSellOrder(Order *);
+    bool processBuyOrder(Order *);
+    void processCancelOrder(Order *);
+    void processAmendOrder(Order *, uint32_t price, uint32_t count, int64_t input_time);
+    template <typename Side> bool processOrder(Order *);
+    template <typename Side> void cancelOrder(Order *);
+    template <typename Side> void cancelSessionOrders(Session &, std::vector<OrderNode*>, int64_t input_time);
     std::string instrument;
     std::mutex m;
+    // taken under the lock of the level an order joins, or batch_m, so every
+    // queue is in sequence order
+    std::atomic<uint64_t> sequence;
 
     BuyBook buyBook;
     SellBook sellBook;
-    OrderBook(std::string instrument): instrument{instrument}, m{}, buyBook{}, sellBook{} {}
-    OrderBook(): instrument{}, m{}, buyBook{}, sellBook{} {}
+    template <typename Side> BookSide<Side> &side() {
+        if constexpr (Side::is_sell_side) {
+            return sellBook;
+        } else {
+            return buyBook;
+        }
+    }
+    std::atomic<uint32_t> md_inputs{0};
+
+    // batch auction mode: orders and cancels wait in batch until the next auction
+    bool batched;
+    std::mutex batch_m;
+    std::vector<Order*> batch;
+    // the buys and sells in batch, by id
+    std::unordered_map<uint32_t, Order*> batchOrders;
+    void queueOrder(Order *);
+    void cancelQueuedOrders(Session &, int64_t input_time);
+    void runAuction();
+
+    // inputs waiting for a worker, with the executor; scheduled while the book
+    // is queued or being matched
+    std::mutex mailbox_m;
+    std::vector<Mail> mailbox;
+    bool scheduled;
+
+    // held by the connection whose frame goes to the book until the frame is
+    // handled: turn with the reactor, turn_m on a connection's own thread
+    Reactor::Lock turn;
+    std::mutex turn_m;
+
+    OrderBook(std::string instrument, bool batched = false): instrument{instrument}, m{}, sequence{0},
+        buyBook{sequence}, sellBook{sequence}, batched{batched}, batch_m{}, batch{}, batchOrders{}, mailbox_m{},
+        mailbox{}, scheduled{false}, turn{}, turn_m{} {}
+    OrderBook(): instrument{}, m{}, sequence{0}, buyBook{sequence}, sellBook{sequence}, batched{false},
+        batch_m{}, batch{}, batchOrders{}, mailbox_m{}, mailbox{}, scheduled{false}, turn{}, turn_m{} {}
+
+    ARENA_ALLOCATED
 };
 
 
 class Engine {
     HashMap<std::string, OrderBook*> orderBooks;
+    std::vector<OrderBook*> auctionBooks;
+    std::atomic<uint32_t> nextSessionId;
+    bool cancelOnDisconnect;
+    // every book, for the stats; orderBooks cannot be walked
+    std::mutex allBooksM;
+    std::vector<OrderBook*> allBooks;
+    int64_t startTime;
+    // serves the connections if set, rather than a thread each
+    Reactor *reactor;
+    // matches the books if set, rather than the connections' threads
+    Executor *executor;
+    // books a connection has used, repeated instruments skip the shared map
+    using BookCache = std::unordered_map<std::string, OrderBook*>;
+    OrderBook *GetOrderBook(const std::string &instrument, BookCache &);
+    OrderBook *ProcessInput(Session &, const input &, BookCache &);
+    void ProcessFrame(Session &, const std::vector<input> &, BookCache &, std::vector<OrderBook*> &snapshots);
+    void Disconnect(Session &);
     void ConnectionThread(ClientConnection);
+    Reactor::Task ConnectionTask(ClientConnection);
+    // book the input goes to, if any
+    OrderBook *BookOf(const input &, BookCache &);
+    // the frame's books, each once and in address order, the order their
+    // turns are taken in
+    void BooksOf(const std::vector<input> &, BookCache &, std::vector<OrderBook*> &);
+    // with the executor: leaves the input in its book's mailbox, or handles it
+    // here if it has no book, returning the book as ProcessInput does
+    OrderBook *Dispatch(Session &, const input &, BookCache &);
+    void RunBook(OrderBook *);
+    // until the session's inputs in mailboxes are handled
+    void Settle(Session &);
+    void AuctionThread(std::chrono::milliseconds);
+    void MassCancel(Session &, int64_t input_time);
+    void ReportDepth(const input &, int64_t input_time);
+    void StatsThread(int listenfd);
+    std::string StatsReport(const Stats::Totals &now, const Stats::Totals &before, int64_t elapsed);
 public:
-    static HashMap<uint32_t, std::shared_ptr<Order>> orders;
-    Engine(): orderBooks{} {};
+    static OrderTable orders;
+    static MarketData marketData;
+    Engine();
     void Accept(ClientConnection);
 };
 
@@ -0,0 +1,97 @@
+#include "epoch.hpp"
+
+#include <vector>
+
+#include "stats.hpp"
+
+// how many objects a thread retires between two attempts to free some
+static constexpr size_t COLLECT_EVERY = 64;
+static constexpr uint64_t IDLE = UINT64_MAX;
+
+struct alignas(64) Epoch::Participant {
+    struct Retired {
+        void *object;
+        void (*free)(void *);
+        uint64_t epoch;
+    };
+
+    std::atomic<uint64_t> epoch;    // announced by the guard, IDLE outside one
+    std::atomic<bool> in_use;
+    Participant *next;
+    // retired objects in epoch order; a thread that exits leaves them to the
+    // next thread taking over the record
+    std::vector<Retired> retired;
+
+    Participant(): epoch{IDLE}, in_use{true}, next{nullptr}, retired{} {}
+};
+
+std::atomic<uint64_t> Epoch::global{0};
+std::atomic<Epoch::Participant*> Epoch::participants{nullptr};
+
+Epoch::Participant &Epoch::self() {
+    // the record of this thread, returned to the pool when the thread exits
+    static thread_local struct Slot {
+        Participant *participant;
+
+        Slot(): participant{nullptr} {
+            for (Participant *p = participants.load(); p != nullptr; p = p->next) {
+                bool free = false;
+                if (p->in_use.compare_exchange_strong(free, true)) {
+                    participant = p;
+                    return;
+                }
+            }
+            participant = new Participant{};
+            participant->next = participants.load();
+            while (!participants.compare_exchange_weak(participant->next, participant)) {
+            }
+        }
+        ~Slot() { participant->in_use.store(false); }
+    } slot;
+    return *slot.participant;
+}
+
+Epoch::Guard::Guard(): participant{self()} {
+    participant.epoch.store(global.load(), std::memory_order_relaxed);
+    // the announcement must be visible before this thread reads any pointer
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+Epoch::Guard::~Guard() {
+    participant.epoch.store(IDLE, std::memory_order_release);
+}
+
+void Epoch::retire(void *object, void (*free)(void *)) {
+    Participant &participant = self();
+    participant.retired.push_back({object, free, global.load()});
+    Stats::Count(Stats::Retired);
+    if (participant.retired.size() % COLLECT_EVERY == 0) {
+        collect(participant);
+    }
+}
+
+void Epoch::collect(Participant &participant) {
+    // move the epoch on if every thread inside a guard has caught up with it
+    uint64_t epoch = global.load();
+    bool behind = false;
+    for (Participant *p = participants.load(); p != nullptr; p = p->next) {
+        uint64_t announced = p->epoch.load();
+        if (announced != IDLE && announced != epoch) {
+            behind = true;
+            break;
+        }
+    }
+    if (!behind) {
+        global.compare_exchange_strong(epoch, epoch + 1);
+        epoch = global.load();
+    }
+
+    auto &retired = participant.retired;
+    size_t done = 0;
+    while (done < retired.size() && retired[done].epoch + 2 <= epoch) {
+        retired[done].free(retired[done].object);
+        done++;
+    }
+    retired.erase(retired.begin(), retired.begin() + done);
+    Stats::Count(Stats::Freed, static_cast<int64_t>(done));
+}
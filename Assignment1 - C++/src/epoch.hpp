@@ -0,0 +1,50 @@
+// This file contains the epoch-based reclamation of orders and price levels.
+//
+// Threads reach orders and levels that another thread may be taking out of
+// a book at the same time: a cancel or an amend finds its order by id while a
+// match fills it, an amend or a mass cancel goes straight to the level an
+// order rested on. Whatever leaves a book is therefore retired rather than
+// deleted, and freed only once no thread can still be looking at it.
+//
+// Each thread handles its inputs inside a Guard. Entering a guard publishes
+// the global epoch the thread saw, and the global epoch only moves on once
+// every thread inside a guard has seen the current one. An object retired in
+// epoch e can no longer be reached by anyone when the global epoch is e + 2;
+// the thread that retired it frees it the next time it collects. Guards do
+// not nest.
+
+#ifndef EPOCH_HPP
+#define EPOCH_HPP
+
+#include <atomic>
+#include <cstdint>
+
+class Epoch {
+    struct Participant;
+
+    static std::atomic<uint64_t> global;
+    // every thread that ever entered a guard; records are reused, never freed
+    static std::atomic<Participant*> participants;
+
+    static Participant &self();
+    static void retire(void *object, void (*free)(void *));
+    static void collect(Participant &);
+
+public:
+    class Guard {
+        Participant &participant;
+    public:
+        Guard();
+        ~Guard();
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+    };
+
+    // frees object once no thread inside a guard can still reach it; the
+    // caller must have made it unreachable first
+    template <typename T> static void retire(T *object) {
+        retire(object, [](void *p) { delete static_cast<T*>(p); });
+    }
+};
+
+#endif
@@ -0,0 +1,68 @@
+#include "executor.hpp"
+
+#include <thread>
+
+thread_local uint32_t Executor::self{0};
+
+Executor::Executor(uint32_t threads, std::function<void(OrderBook *)> run): count{threads},
+    workers{new Worker[threads]}, run{std::move(run)}, idle_m{}, idle{}, sleeping{0} {
+    for (uint32_t i = 0; i < count; i++) {
+        std::thread thread{&Executor::work, this, i};
+        thread.detach();
+    }
+}
+
+void Executor::Schedule(OrderBook *book) {
+    // a book goes back to the worker that had it, a new one to a worker of its
+    // own, its address spread over the workers
+    uint32_t i = self != 0 ? self - 1 : static_cast<uint32_t>((reinterpret_cast<uintptr_t>(book) >> 6) % count);
+    {
+        std::lock_guard<std::mutex> lock{workers[i].m};
+        workers[i].ready.push_back(book);
+    }
+    if (sleeping.load() != 0) {
+        std::lock_guard<std::mutex> lock{idle_m};
+        idle.notify_one();
+    }
+}
+
+OrderBook *Executor::take(uint32_t worker) {
+    for (uint32_t n = 0; n < count; n++) {
+        Worker &from = workers[(worker + n) % count];
+        std::lock_guard<std::mutex> lock{from.m};
+        if (from.ready.empty()) {
+            continue;
+        }
+        OrderBook *book;
+        if (n == 0) {
+            book = from.ready.front();
+            from.ready.pop_front();
+        } else {
+            book = from.ready.back();
+            from.ready.pop_back();
+        }
+        return book;
+    }
+    return nullptr;
+}
+
+void Executor::work(uint32_t worker) {
+    self = worker + 1;
+    while (true) {
+        OrderBook *book = take(worker);
+        if (book == nullptr) {
+            // counted before looking again: a book queued after this look
+            // finds the count up, and its Schedule wakes a worker
+            std::unique_lock<std::mutex> lock{idle_m};
+            sleeping++;
+            book = take(worker);
+            if (book == nullptr) {
+                idle.wait(lock);
+            }
+            sleeping--;
+        }
+        if (book != nullptr) {
+            run(book);
+        }
+    }
+}
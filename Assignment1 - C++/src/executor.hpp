@@ -0,0 +1,57 @@
+// This file contains the executor matching books on a pool of workers, with
+// ENGINE_MATCHING_WORKERS set, rather than on the connections' threads. Only
+// with a thread per connection: a connection may wait for its inputs to be
+// matched, which the reactor's threads must not.
+//
+// A connection leaves its inputs in the mailbox of their book; a book with
+// inputs waiting is ready, and the executor hands ready books to its
+// workers. Every worker has a queue of ready books. It takes the oldest of
+// its own, and when it has none it steals the newest from another worker, so
+// the workers stay busy whichever books the flow goes to. A book is in at
+// most one queue at a time and a worker empties its mailbox before it lets
+// go of it, so a book is only ever matched by one worker at a time.
+
+#ifndef EXECUTOR_HPP
+#define EXECUTOR_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+class OrderBook;
+
+class Executor {
+    struct alignas(64) Worker {
+        std::mutex m;
+        std::deque<OrderBook*> ready;
+    };
+
+    uint32_t count;
+    std::unique_ptr<Worker[]> workers;
+    std::function<void(OrderBook *)> run;
+    // workers with nothing to take wait on idle; sleeping says if any does
+    std::mutex idle_m;
+    std::condition_variable idle;
+    std::atomic<uint32_t> sleeping;
+    // the worker this thread is, plus one; 0 on other threads
+    static thread_local uint32_t self;
+
+    OrderBook *take(uint32_t worker);
+    void work(uint32_t worker);
+
+public:
+    // starts threads workers, calling run on every book they take
+    Executor(uint32_t threads, std::function<void(OrderBook *)> run);
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    // queues a book that has inputs waiting and is not queued yet; onto the
+    // queue of the calling worker, or of the book's usual worker
+    void Schedule(OrderBook *);
+};
+
+#endif
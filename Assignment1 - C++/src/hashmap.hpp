@@ -61,7 +61,8 @@ public:
 
     // Keys are not updated
     // if key exist, do nothing
-    void put(const K &key, const V &value) {
+    // returns whether the key was added
+    bool put(const K &key, const V &value) {
         size_t hash = hashF(key) % size;
         auto& m = bucketMutexes[hash];
         std::unique_lock<std::shared_mutex> lock(m);
@@ -74,14 +75,16 @@ public:
             curr = curr->getNext();
         }
 
-        if (curr == nullptr) {
-            curr = new HashNode<K, V>(key, value);
-            if (prev == nullptr) {
-                hashTable[hash] = curr;
-            } else {
-                prev->setNext(curr);
-            }
+        if (curr != nullptr) {
+            return false;
+        }
+        curr = new HashNode<K, V>(key, value);
+        if (prev == nullptr) {
+            hashTable[hash] = curr;
+        } else {
+            prev->setNext(curr);
         }
+        return true;
     }
 
 
@@ -13,10 +13,12 @@ void engine_accept(void *engine, void *file) {
 }
 
 int read_input(void *file, struct input *output);
+int read_inputs(void *file, struct input *output, size_t count);
 
 struct _IO_FILE;
 typedef struct _IO_FILE FILE;
 int fclose(FILE *stream);
+int fileno(FILE *stream);
 }
 
 void ClientConnection::FreeHandle() {
@@ -26,6 +28,10 @@ void ClientConnection::FreeHandle() {
   }
 }
 
+int ClientConnection::Descriptor() const {
+  return fileno(static_cast<FILE *>(handle));
+}
+
 ReadResult ClientConnection::ReadInput(input &read_into) {
   switch (read_input(handle, &read_into)) {
     case 1:
@@ -36,3 +42,14 @@ ReadResult ClientConnection::ReadInput(input &read_into) {
       return ReadResult::Error;
   }
 }
+
+ReadResult ClientConnection::ReadInputs(input *read_into, size_t count) {
+  switch (read_inputs(handle, read_into, count)) {
+    case 1:
+      return ReadResult::EndOfFile;
+    case 0:
+      return ReadResult::Success;
+    default:
+      return ReadResult::Error;
+  }
+}
@@ -1,5 +1,7 @@
-// This file contains definitions used by the provided I/O code.
-// There should be no need to modify this file.
+// This file contains definitions used by the provided I/O code: the inputs
+// a client sends and the output lines the engine prints for them. An input
+// or output added to the engine is added here, with the client (client.c)
+// and the output parsers (grader/output.cpp, test/checker.cpp) kept in step.
 
 #ifndef IO_H
 #define IO_H
@@ -9,12 +11,27 @@
 #include <iostream>
 #include <sstream>
 
+#include "trace.hpp"
+#include "writer.hpp"
+
 extern "C" {
 #else
 #include <stdint.h>
 #endif
 
-enum input_type { input_buy = 'B', input_sell = 'S', input_cancel = 'C' };
+enum input_type {
+  input_buy = 'B',
+  input_sell = 'S',
+  input_cancel = 'C',
+  input_mass_cancel = 'M',
+  input_amend = 'A',
+  input_batch = 'F',
+  input_depth = 'D'
+};
+
+// A batch frame is an input of type input_batch whose count says how many
+// inputs follow it, at most INPUT_BATCH_MAX.
+#define INPUT_BATCH_MAX 1024
 
 struct input {
   enum input_type type;
@@ -53,6 +70,9 @@ class ClientConnection {
   inline ~ClientConnection() { FreeHandle(); }
 
   ReadResult ReadInput(input& read_into);
+  ReadResult ReadInputs(input* read_into, size_t count);
+  // the socket, for reading it without the stream (see reactor.hpp)
+  int Descriptor() const;
 };
 
 class Output {
@@ -62,14 +82,15 @@ class Output {
                                 bool is_sell_side,
                                 intmax_t input_timestamp,
                                 intmax_t output_timestamp) {
-      std::stringstream msg;
-      msg << (is_sell_side ? "S" : "B") << " " << id << " " << symbol
-          << " " << price << " " << count << " " << input_timestamp
-          << " " << output_timestamp << "\n";
+      TRACE_POINT(id, Output);
+      OutputLine msg;
+      msg << (is_sell_side ? 'S' : 'B') << ' ' << id << ' ' << symbol
+          << ' ' << price << ' ' << count << ' ' << input_timestamp
+          << ' ' << output_timestamp << '\n';
 //      std::cout << (is_sell_side ? "S" : "B") << " " << id << " " << symbol
 //              << " " << price << " " << count << " " << input_timestamp
 //              << " " << output_timestamp << std::endl;
-        std::cout << msg.str() << std::flush;
+      msg.Write();
   }
 
   inline static void OrderExecuted(uint32_t resting_id, uint32_t new_id,
@@ -77,25 +98,63 @@ class Output {
                                    uint32_t count,
                                    intmax_t input_timestamp,
                                    intmax_t output_timestamp) {
-      std::stringstream msg;
-      msg << "E " << resting_id << " " << new_id << " "
-             << execution_id << " " << price << " " << count << " "
-             << input_timestamp << " " << output_timestamp << "\n";
+      TRACE_POINT(resting_id, Fill);
+      TRACE_POINT(new_id, Output);
+      OutputLine msg;
+      msg << "E " << resting_id << ' ' << new_id << ' '
+             << execution_id << ' ' << price << ' ' << count << ' '
+             << input_timestamp << ' ' << output_timestamp << '\n';
 //    std::cout << "E " << resting_id << " " << new_id << " "
 //              << execution_id << " " << price << " " << count << " "
 //              << input_timestamp << " " << output_timestamp << std::endl;
-        std::cout << msg.str() << std::flush;
+      msg.Write();
   }
 
   inline static void OrderDeleted(uint32_t id, bool cancel_accepted,
                                   intmax_t input_timestamp,
                                   intmax_t output_timestamp) {
-      std::stringstream msg;
-      msg << "X " << id << " " << (cancel_accepted ? "A" : "R") << " "
-                << input_timestamp << " " << output_timestamp << "\n";
+      TRACE_POINT(id, Output);
+      OutputLine msg;
+      msg << "X " << id << ' ' << (cancel_accepted ? 'A' : 'R') << ' '
+                << input_timestamp << ' ' << output_timestamp << '\n';
 //    std::cout << "X " << id << " " << (cancel_accepted ? "A" : "R") << " "
 //              << input_timestamp << " " << output_timestamp << std::endl;
-      std::cout << msg.str() << std::flush;
+      msg.Write();
+  }
+
+  // A price change is reported like a cancel and a new order in one: the
+  // amend line is followed by the executions and the add of the new order.
+  inline static void OrderAmended(uint32_t id, bool amend_accepted,
+                                  uint32_t price, uint32_t count,
+                                  intmax_t input_timestamp,
+                                  intmax_t output_timestamp) {
+      TRACE_POINT(id, Output);
+      OutputLine msg;
+      msg << "A " << id << ' ' << (amend_accepted ? 'A' : 'R') << ' '
+          << price << ' ' << count << ' ' << input_timestamp << ' '
+          << output_timestamp << '\n';
+      msg.Write();
+  }
+
+  // The top levels of both sides of a book, best first, bids then asks. Each
+  // side is its number of levels followed by price, volume and order count
+  // for every level. The line goes out with the order output, and the grader
+  // skips it by its "D " tag.
+  template <typename Levels>
+  inline static void BookDepth(const char* symbol, const Levels& bids,
+                               const Levels& asks, intmax_t input_timestamp,
+                               intmax_t output_timestamp) {
+      OutputLine msg;
+      msg << "D " << symbol;
+      for (const Levels* side : {&bids, &asks}) {
+        msg << ' ' << side->size();
+        for (const auto& level : *side) {
+          msg << ' ' << level.price << ' ' << level.volume << ' '
+              << level.orders;
+        }
+      }
+      msg << ' ' << input_timestamp << ' ' << output_timestamp << '\n';
+      msg.Write();
   }
 };
 #endif
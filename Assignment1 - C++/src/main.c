@@ -25,6 +25,13 @@ int read_input(void *file, struct input *output) {
   return 0;
 }
 
+int read_inputs(void *file, struct input *output, size_t count) {
+  if (fread_unlocked(output, sizeof(*output), count, file) != count) {
+    return feof(file) ? 1 : -1;
+  }
+  return 0;
+}
+
 static int listenfd = -1;
 static char *socketpath = NULL;
 
@@ -0,0 +1,81 @@
+#include "marketdata.hpp"
+
+#include <cinttypes>
+#include <cstring>
+
+#include "engine.hpp"
+
+thread_local std::vector<MarketData::LevelUpdate> MarketData::pending{};
+
+bool MarketData::open(const std::string &path, uint32_t interval) {
+    // opening a fifo blocks until the consumer shows up
+    channel = fopen(path.c_str(), "w");
+    if (channel == nullptr) {
+        return false;
+    }
+    snapshot_interval = interval;
+    return true;
+}
+
+void MarketData::levelChanged(const std::string &instrument, OrderNode *node, bool is_sell_side) {
+    node->md_seq = ++seq;
+
+    // coalesce with an earlier change to the same level in this frame. The
+    // slot may be stale, or another thread's if it changed the level since;
+    // the update is then queued again, which costs a line but no correctness
+    if (node->md_slot < pending.size() && pending[node->md_slot].node == node) {
+        LevelUpdate &update = pending[node->md_slot];
+        update.volume = node->volume;
+        update.seq = node->md_seq;
+        return;
+    }
+
+    LevelUpdate update{node, {}, is_sell_side, node->price, node->volume, node->md_seq};
+    strncpy(update.instrument, instrument.c_str(), sizeof(update.instrument) - 1);
+    node->md_slot = static_cast<uint32_t>(pending.size());
+    pending.push_back(update);
+}
+
+void MarketData::Flush() {
+    if (pending.empty()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock{channel_m};
+    for (auto &update : pending) {
+        fprintf(channel, "D %s %c %" PRIu32 " %" PRIu32 " %" PRIu64 "\n", update.instrument,
+                update.is_sell_side ? 'S' : 'B', update.price, update.volume, update.seq);
+    }
+    fflush(channel);
+    pending.clear();
+}
+
+bool MarketData::SnapshotDue(OrderBook &book) {
+    if (channel == nullptr || snapshot_interval == 0) {
+        return false;
+    }
+    return ++book.md_inputs % snapshot_interval == 0;
+}
+
+// Holding channel_m for the whole walk keeps any update newer than what the
+// snapshot read behind it on the channel. The levels are read without their
+// locks, so matching goes on while a book is written out.
+template <typename Side>
+void MarketData::writeSide(const std::string &instrument, BookSide<Side> &side) {
+    static thread_local std::vector<LevelView> levels;
+    side.depth(SIZE_MAX, levels);
+    for (const LevelView &level : levels) {
+        fprintf(channel, "F %s %c %" PRIu32 " %" PRIu32 " %" PRIu64 "\n", instrument.c_str(),
+                Side::is_sell_side ? 'S' : 'B', level.price, level.volume, level.md_seq);
+    }
+}
+
+void MarketData::Snapshot(OrderBook &book) {
+    std::lock_guard<std::mutex> lock{channel_m};
+    // a level's volume is set before its update is numbered, so the walk
+    // below sees every update numbered up to here
+    fprintf(channel, "R %s %" PRIu64 "\n", book.instrument.c_str(), seq.load());
+    writeSide(book.instrument, book.buyBook);
+    writeSide(book.instrument, book.sellBook);
+    fflush(channel);
+}
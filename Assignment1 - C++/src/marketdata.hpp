@@ -0,0 +1,82 @@
+// This file contains declarations for the level-2 market data feed.
+//
+// Whenever the aggregate volume of a price level changes, the engine
+// publishes a depth update on a separate channel (a file or a fifo):
+//
+//     D <instrument> <B|S> <price> <volume> <seq>
+//
+// Changes made to the same level while handling one input are coalesced
+// into a single update. A volume of 0 means the level is gone.
+//
+// Every so often each book is also published in full, for consumers that
+// join late:
+//
+//     R <instrument> <seq>                            (drop the book)
+//     F <instrument> <B|S> <price> <volume> <seq>     (one line per level)
+//
+// Sequence numbers are taken from one engine-wide counter while the level
+// is locked, so they increase for every level. Updates from different
+// connections can reach the channel out of order. A consumer should apply
+// a D or F line only if its sequence number is newer than the last one it
+// applied to that level. The sequence number of an R line is the counter
+// when the snapshot was taken: every update numbered up to it is in the F
+// lines that follow, so a consumer drops any later D line of that
+// instrument at or below it, even for a level the snapshot does not list.
+
+#ifndef MARKETDATA_HPP
+#define MARKETDATA_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct OrderNode;
+class OrderBook;
+template <typename Side> struct BookSide;
+
+class MarketData {
+    struct LevelUpdate {
+        const OrderNode *node;
+        char instrument[9];
+        bool is_sell_side;
+        uint32_t price;
+        uint32_t volume;
+        uint64_t seq;
+    };
+
+    FILE *channel;
+    std::mutex channel_m;
+    std::atomic<uint64_t> seq;
+    uint32_t snapshot_interval;
+
+    // levels touched by the input this thread is handling
+    static thread_local std::vector<LevelUpdate> pending;
+
+    void levelChanged(const std::string &instrument, OrderNode *node, bool is_sell_side);
+    template <typename Side> void writeSide(const std::string &instrument, BookSide<Side> &side);
+
+public:
+    MarketData(): channel{nullptr}, channel_m{}, seq{0}, snapshot_interval{0} {}
+
+    bool open(const std::string &path, uint32_t snapshot_interval);
+    bool enabled() const { return channel != nullptr; }
+
+    // must be called while holding node->m, after node->volume was updated
+    inline void LevelChanged(const std::string &instrument, OrderNode *node, bool is_sell_side) {
+        if (channel != nullptr) {
+            levelChanged(instrument, node, is_sell_side);
+        }
+    }
+
+    // publishes the coalesced updates of the input this thread just handled
+    void Flush();
+
+    // counts an input to the book, returns true when it is time to snapshot it
+    bool SnapshotDue(OrderBook &book);
+    void Snapshot(OrderBook &book);
+};
+
+#endif
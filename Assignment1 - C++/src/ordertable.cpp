@@ -0,0 +1,44 @@
+#include "ordertable.hpp"
+
+#include <new>
+#include <sys/mman.h>
+
+#include "arena.hpp"
+
+void OrderTable::configure(uint32_t limit, bool prefault) {
+    uint64_t count = (uint64_t{limit} + SEGMENT_SIZE - 1) >> SEGMENT_BITS;
+    segments = new std::atomic<Slot*>[count]{};
+    this->limit = limit;
+    if (prefault && count != 0) {
+        // one mapping for the whole table, its segments are never unmapped
+        void *memory = Arena::Map(count * SEGMENT_SIZE * sizeof(Slot), true);
+        if (memory == nullptr) {
+            throw std::bad_alloc{};
+        }
+        for (uint64_t i = 0; i < count; i++) {
+            segments[i].store(static_cast<Slot*>(memory) + i * SEGMENT_SIZE, std::memory_order_relaxed);
+        }
+    }
+}
+
+OrderTable::Slot *OrderTable::segment(uint32_t id) {
+    std::atomic<Slot*> &entry = segments[id >> SEGMENT_BITS];
+    Slot *slots = entry.load(std::memory_order_acquire);
+    if (slots != nullptr) {
+        return slots;
+    }
+
+    // anonymous memory is zeroed, and pages are only backed once touched
+    void *memory = mmap(nullptr, SEGMENT_SIZE * sizeof(Slot), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        throw std::bad_alloc{};
+    }
+    Slot *mapped = static_cast<Slot*>(memory);
+    if (!entry.compare_exchange_strong(slots, mapped, std::memory_order_acq_rel)) {
+        // another thread mapped the segment first
+        munmap(memory, SEGMENT_SIZE * sizeof(Slot));
+        return slots;
+    }
+    return mapped;
+}
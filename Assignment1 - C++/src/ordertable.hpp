@@ -0,0 +1,72 @@
+// This file contains the table of resting orders by id.
+//
+// Order ids are dense, assigned in sequence by the gateway, so ids below a
+// configured limit are kept in an array indexed by the id itself: a lookup,
+// an insert or a removal is one atomic access to one slot, with no hashing
+// and no lock. The array is split in segments of 64Ki ids that are mapped on
+// first use, so a range of ids that is never used costs nothing, or all at
+// once when the table is prefaulted. Ids at or above the limit go to a hash
+// map.
+
+#ifndef ORDERTABLE_HPP
+#define ORDERTABLE_HPP
+
+#include <atomic>
+#include <cstdint>
+
+#include "hashmap.hpp"
+
+struct Order;
+
+class OrderTable {
+    static constexpr uint32_t SEGMENT_BITS = 16;
+    static constexpr uint32_t SEGMENT_SIZE = 1 << SEGMENT_BITS;
+
+    using Slot = std::atomic<Order*>;
+
+    uint32_t limit;
+    std::atomic<Slot*> *segments;
+    HashMap<uint32_t, Order*> overflow;
+
+    Slot *segment(uint32_t id);
+
+public:
+    OrderTable(): limit{0}, segments{nullptr}, overflow{} {}
+    OrderTable(const OrderTable &) = delete;
+    OrderTable &operator=(const OrderTable &) = delete;
+
+    // ids below limit are indexed directly; call once, before any other use.
+    // With prefault, every segment is mapped and touched now, on hugepages if
+    // there are any (see arena.hpp), rather than when its first id comes.
+    void configure(uint32_t limit, bool prefault = false);
+
+    // same contract as HashMap: put does nothing if the id is already there
+    bool get(uint32_t id, Order *&order) {
+        if (id >= limit) {
+            return overflow.get(id, order);
+        }
+        Slot *slots = segments[id >> SEGMENT_BITS].load(std::memory_order_acquire);
+        order = slots != nullptr ? slots[id & (SEGMENT_SIZE - 1)].load(std::memory_order_acquire) : nullptr;
+        return order != nullptr;
+    }
+    void put(uint32_t id, Order *order) {
+        if (id >= limit) {
+            overflow.put(id, order);
+            return;
+        }
+        Order *empty = nullptr;
+        segment(id)[id & (SEGMENT_SIZE - 1)].compare_exchange_strong(empty, order, std::memory_order_release);
+    }
+    void remove(uint32_t id) {
+        if (id >= limit) {
+            overflow.remove(id);
+            return;
+        }
+        Slot *slots = segments[id >> SEGMENT_BITS].load(std::memory_order_acquire);
+        if (slots != nullptr) {
+            slots[id & (SEGMENT_SIZE - 1)].store(nullptr, std::memory_order_release);
+        }
+    }
+};
+
+#endif
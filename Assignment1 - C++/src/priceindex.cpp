@@ -0,0 +1,208 @@
+#include "priceindex.hpp"
+
+#include <bit>
+
+#include "engine.hpp"
+
+OrderNode *PriceIndex::find(uint32_t price) {
+    TrieNode *node = &root;
+    for (int depth = 0; depth < DEPTH - 1; depth++) {
+        node = node->child(slot(price, depth));
+        if (node == nullptr) {
+            return nullptr;
+        }
+    }
+    return node->level(slot(price, DEPTH - 1));
+}
+
+OrderNode *PriceIndex::findOrCreate(uint32_t price) {
+    TrieNode *node = &root;
+    for (int depth = 0; depth < DEPTH - 1; depth++) {
+        unsigned i = slot(price, depth);
+        TrieNode *child = node->child(i);
+        if (child == nullptr) {
+            beginChange();
+            child = new TrieNode{};
+            node->slots[i].store(child, std::memory_order_release);
+            endChange();
+        }
+        node = child;
+    }
+    unsigned i = slot(price, DEPTH - 1);
+    OrderNode *level = node->level(i);
+    if (level == nullptr) {
+        beginChange();
+        level = new OrderNode{price};
+        node->slots[i].store(level, std::memory_order_release);
+        endChange();
+    }
+    return level;
+}
+
+void PriceIndex::markOccupied(uint32_t price) {
+    TrieNode *node = &root;
+    for (int depth = 0; depth < DEPTH; depth++) {
+        uint64_t bit = uint64_t{1} << slot(price, depth);
+        if ((node->occupied.load(std::memory_order_relaxed) & bit) == 0) {
+            node->occupied.fetch_or(bit);
+        }
+        if (depth < DEPTH - 1) {
+            node = node->child(slot(price, depth));
+        }
+    }
+}
+
+void PriceIndex::markEmpty(uint32_t price) {
+    // only the leaf bit: the summaries above are dropped by the next search
+    // that finds nothing under them, which runs under the head lock
+    TrieNode *node = &root;
+    for (int depth = 0; depth < DEPTH - 1; depth++) {
+        node = node->child(slot(price, depth));
+    }
+    node->occupied.fetch_and(~(uint64_t{1} << slot(price, DEPTH - 1)));
+}
+
+void PriceIndex::erase(uint32_t price) {
+    // interior trie nodes stay, a price range that was used once is likely to be again
+    TrieNode *node = &root;
+    for (int depth = 0; depth < DEPTH - 1; depth++) {
+        node = node->child(slot(price, depth));
+    }
+    beginChange();
+    node->slots[slot(price, DEPTH - 1)].store(nullptr, std::memory_order_release);
+    endChange();
+}
+
+void PriceIndex::addVolume(uint32_t price, int64_t delta) {
+    TrieNode *node = &root;
+    for (int depth = 0; depth < DEPTH; depth++) {
+        unsigned i = slot(price, depth);
+        node->volume[i].fetch_add(static_cast<uint64_t>(delta), std::memory_order_relaxed);
+        if (depth < DEPTH - 1) {
+            node = node->child(i);
+        }
+    }
+}
+
+OrderNode *PriceIndex::reach(uint64_t quantity, bool ascending) {
+    TrieNode *node = &root;
+    for (int depth = 0; depth < DEPTH; depth++) {
+        uint64_t bits = node->occupied.load();
+        unsigned i = 0;
+        while (true) {
+            if (bits == 0) {
+                return nullptr;
+            }
+            i = ascending ? std::countr_zero(bits) : FANOUT - 1 - std::countl_zero(bits);
+            uint64_t volume = node->volume[i].load(std::memory_order_relaxed);
+            if (volume >= quantity) {
+                break;
+            }
+            quantity -= volume;
+            bits &= ~(uint64_t{1} << i);
+        }
+        if (depth == DEPTH - 1) {
+            return node->level(i);
+        }
+        node = node->child(i);
+    }
+    return nullptr;
+}
+
+void PriceIndex::collect(TrieNode *node, int depth, uint32_t to, bool ascending, std::vector<OrderNode*> &out) {
+    unsigned last = slot(to, depth);
+    uint64_t bits = node->occupied.load() &
+                    (ascending ? ~uint64_t{0} >> (FANOUT - 1 - last) : ~uint64_t{0} << last);
+    while (bits != 0) {
+        unsigned i = ascending ? std::countr_zero(bits) : FANOUT - 1 - std::countl_zero(bits);
+        if (depth == DEPTH - 1) {
+            out.push_back(node->level(i));
+        } else {
+            // short of the last slot, every price of the child is on this side of to
+            collect(node->child(i), depth + 1, i == last ? to : (ascending ? UINT32_MAX : 0), ascending, out);
+        }
+        bits &= ~(uint64_t{1} << i);
+    }
+}
+
+void PriceIndex::scan(uint32_t from, size_t n, bool ascending, std::vector<OrderNode*> &out) {
+    size_t start = out.size();
+    while (true) {
+        uint64_t before = version.load(std::memory_order_acquire);
+        if ((before & 1) == 0) {
+            size_t left = n;
+            scan(&root, 0, from, left, ascending, out);
+            // the reads above may not move past the second load of version
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (version.load(std::memory_order_relaxed) == before) {
+                return;
+            }
+        }
+        out.resize(start);
+    }
+}
+
+void PriceIndex::scan(TrieNode *node, int depth, uint32_t from, size_t &n, bool ascending,
+                      std::vector<OrderNode*> &out) {
+    // like collect, but from a price rather than up to one, and read only: the
+    // summary bits are left for the searches under the head lock to tidy
+    unsigned first = slot(from, depth);
+    uint64_t bits = node->occupied.load(std::memory_order_acquire) &
+                    (ascending ? ~uint64_t{0} << first : ~uint64_t{0} >> (FANOUT - 1 - first));
+    while (bits != 0 && n > 0) {
+        unsigned i = ascending ? std::countr_zero(bits) : FANOUT - 1 - std::countl_zero(bits);
+        if (depth == DEPTH - 1) {
+            if (OrderNode *level = node->level(i); level != nullptr) {
+                out.push_back(level);
+                n--;
+            }
+        } else {
+            scan(node->child(i), depth + 1, i == first ? from : (ascending ? 0 : UINT32_MAX), n, ascending, out);
+        }
+        bits &= ~(uint64_t{1} << i);
+    }
+}
+
+OrderNode *PriceIndex::ascend(TrieNode *node, int depth, uint32_t from) {
+    unsigned first = slot(from, depth);
+    uint64_t bits = node->occupied.load() & (~uint64_t{0} << first);
+    while (bits != 0) {
+        unsigned i = std::countr_zero(bits);
+        if (depth == DEPTH - 1) {
+            return node->level(i);
+        }
+        // past the first slot every price of the child is >= from
+        TrieNode *child = node->child(i);
+        OrderNode *found = ascend(child, depth + 1, i == first ? from : 0);
+        if (found != nullptr) {
+            return found;
+        }
+        if (child->occupied.load() == 0) {
+            node->occupied.fetch_and(~(uint64_t{1} << i));
+        }
+        bits &= bits - 1;
+    }
+    return nullptr;
+}
+
+OrderNode *PriceIndex::descend(TrieNode *node, int depth, uint32_t from) {
+    unsigned last = slot(from, depth);
+    uint64_t bits = node->occupied.load() & (~uint64_t{0} >> (FANOUT - 1 - last));
+    while (bits != 0) {
+        unsigned i = FANOUT - 1 - std::countl_zero(bits);
+        if (depth == DEPTH - 1) {
+            return node->level(i);
+        }
+        // before the last slot every price of the child is <= from
+        TrieNode *child = node->child(i);
+        OrderNode *found = descend(child, depth + 1, i == last ? from : UINT32_MAX);
+        if (found != nullptr) {
+            return found;
+        }
+        if (child->occupied.load() == 0) {
+            node->occupied.fetch_and(~(uint64_t{1} << i));
+        }
+        bits &= ~(uint64_t{1} << i);
+    }
+    return nullptr;
+}
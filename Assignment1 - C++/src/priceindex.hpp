@@ -0,0 +1,115 @@
+// This file contains the price index used by each side of a book.
+//
+// PriceIndex is a 64-ary trie over the 32-bit price, 6 bits per level. It
+// maps prices to their OrderNode and keeps, at every level of the trie, a
+// bitmap of the children holding at least one non-empty price level. Best
+// price and next-level queries are then one count-trailing/leading-zeros per
+// trie level, however many empty levels lie in between.
+//
+// Every slot of the trie also carries the volume of the levels under it, so
+// the volume offered through a price, and the level at which a quantity is
+// filled, are one walk down the trie (a segment tree over the price ticks).
+// The volumes are updated with relaxed atomics under the level's lock and
+// read without it, so they can lag behind the levels a little.
+//
+// Locking: the trie itself, and the summary bitmaps above the leaves, only
+// change under the head lock of the side. A leaf bit is set under the head
+// lock and the level's lock, and cleared under the level's lock alone, so a
+// search under the head lock can see a level as occupied after it emptied
+// but never miss one that has orders. Levels are dropped from the index
+// under the head lock too, once they are empty.
+//
+// scan() reads the trie without the head lock. version is a seqlock over
+// the shape of the trie, odd while a trie node or a level goes in or out,
+// and a scan that overlaps one starts again. Trie nodes are never freed and
+// levels are retired, so a scan inside an epoch guard never reads freed
+// memory, even when it goes on to start again.
+
+#ifndef PRICEINDEX_HPP
+#define PRICEINDEX_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "arena.hpp"
+
+struct OrderNode;
+
+class PriceIndex {
+    static constexpr int BITS = 6;
+    static constexpr int FANOUT = 1 << BITS;
+    static constexpr int DEPTH = 6; // 36 bits, the top level only uses 2
+
+    struct TrieNode {
+        std::atomic<uint64_t> occupied;
+        // the children, or the levels in the last level of the trie; atomic as
+        // scan() reads them without the head lock, and stored with release so
+        // it finds what they point to made
+        std::atomic<void*> slots[FANOUT];
+        std::atomic<uint64_t> volume[FANOUT]; // of the levels under each slot
+
+        TrieNode(): occupied{0}, slots{}, volume{} {}
+
+        TrieNode *child(unsigned i) const { return static_cast<TrieNode*>(slots[i].load(std::memory_order_acquire)); }
+        OrderNode *level(unsigned i) const { return static_cast<OrderNode*>(slots[i].load(std::memory_order_acquire)); }
+
+        ARENA_ALLOCATED
+    };
+
+    TrieNode root;
+    std::atomic<uint64_t> version;
+
+    void beginChange() {
+        version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+    void endChange() {
+        version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    static unsigned slot(uint32_t price, int depth) {
+        return (price >> (BITS * (DEPTH - 1 - depth))) & (FANOUT - 1);
+    }
+    OrderNode *ascend(TrieNode *node, int depth, uint32_t from);
+    OrderNode *descend(TrieNode *node, int depth, uint32_t from);
+    void collect(TrieNode *node, int depth, uint32_t to, bool ascending, std::vector<OrderNode*> &out);
+    void scan(TrieNode *node, int depth, uint32_t from, size_t &n, bool ascending, std::vector<OrderNode*> &out);
+
+public:
+    PriceIndex(): root{}, version{0} {}
+    PriceIndex(const PriceIndex &) = delete;
+    PriceIndex &operator=(const PriceIndex &) = delete;
+
+    // both under the head lock
+    OrderNode *find(uint32_t price);
+    OrderNode *findOrCreate(uint32_t price);
+
+    // under the head lock and the level's lock
+    void markOccupied(uint32_t price);
+    // under the level's lock
+    void markEmpty(uint32_t price);
+    // drops an empty level from the index; under the head lock and the level's lock
+    void erase(uint32_t price);
+    // under the level's lock, whenever its volume changes
+    void addVolume(uint32_t price, int64_t delta);
+
+    // occupied level with the lowest price >= from, or the highest price <= from;
+    // under the head lock
+    OrderNode *ascend(uint32_t from) { return ascend(&root, 0, from); }
+    OrderNode *descend(uint32_t from) { return descend(&root, 0, from); }
+
+    // the rest under the head lock, walking prices up or down from the best:
+    // level at which the volume first adds up to quantity, null if there is less
+    OrderNode *reach(uint64_t quantity, bool ascending);
+    // appends the occupied levels up to and including price to, in order
+    void collect(uint32_t to, bool ascending, std::vector<OrderNode*> &out) {
+        collect(&root, 0, to, ascending, out);
+    }
+
+    // without the head lock, inside an epoch guard: appends up to n levels
+    // marked occupied, in order from price from; they may have emptied since
+    void scan(uint32_t from, size_t n, bool ascending, std::vector<OrderNode*> &out);
+};
+
+#endif
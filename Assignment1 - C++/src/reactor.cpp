@@ -0,0 +1,175 @@
+#include "reactor.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+
+static constexpr int EVENTS = 64;
+// a batch frame of INPUT_BATCH_MAX inputs fits twice
+static constexpr size_t READ_SIZE = 64 << 10;
+
+Reactor *Reactor::Create(uint32_t threads) {
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
+    int wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epollfd == -1 || wakefd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &event) != 0) {
+        for (int fd : {epollfd, wakefd}) {
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+        return nullptr;
+    }
+    Reactor *reactor = new Reactor{epollfd, wakefd};
+    for (uint32_t i = 0; i < threads; i++) {
+        std::thread thread{&Reactor::run, reactor};
+        thread.detach();
+    }
+    return reactor;
+}
+
+void Reactor::schedule(std::coroutine_handle<> handle) {
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock{m};
+        wake = ready.empty() && sleeping != 0;
+        ready.push_back(handle);
+    }
+    if (wake) {
+        uint64_t one = 1;
+        if (write(wakefd, &one, sizeof(one)) != sizeof(one)) {
+            // the counter is already set, a thread wakes up anyway
+        }
+    }
+}
+
+void Reactor::run() {
+    epoll_event events[EVENTS];
+    while (true) {
+        // what is ready now; what these schedule waits for the sockets' turn
+        size_t count;
+        {
+            std::lock_guard<std::mutex> lock{m};
+            count = ready.size();
+        }
+        for (size_t i = 0; i < count; i++) {
+            std::coroutine_handle<> handle;
+            {
+                std::lock_guard<std::mutex> lock{m};
+                if (ready.empty()) {
+                    break;
+                }
+                handle = ready.front();
+                ready.pop_front();
+            }
+            handle.resume();
+        }
+
+        // sleep only with nothing ready; counted under m, so schedule either
+        // sees this thread asleep or its waiter is seen here
+        bool idle;
+        {
+            std::lock_guard<std::mutex> lock{m};
+            idle = ready.empty();
+            sleeping += idle;
+        }
+        int n = epoll_wait(epollfd, events, EVENTS, idle ? -1 : 0);
+        if (idle) {
+            std::lock_guard<std::mutex> lock{m};
+            sleeping--;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == nullptr) {
+                uint64_t wakes;
+                if (read(wakefd, &wakes, sizeof(wakes)) != sizeof(wakes)) {
+                    // another thread took the wake up
+                }
+                continue;
+            }
+            std::coroutine_handle<>::from_address(events[i].data.ptr).resume();
+        }
+    }
+}
+
+bool Reactor::Locking::await_ready() {
+    std::lock_guard<std::mutex> guard{lock.m};
+    if (lock.held) {
+        return false;
+    }
+    lock.held = true;
+    return true;
+}
+
+bool Reactor::Locking::await_suspend(std::coroutine_handle<> handle) {
+    // let go since await_ready looked: then it is taken without suspending
+    std::lock_guard<std::mutex> guard{lock.m};
+    if (!lock.held) {
+        lock.held = true;
+        return false;
+    }
+    lock.waiting.push_back(handle);
+    return true;
+}
+
+void Reactor::Unlock(Lock &lock) {
+    std::coroutine_handle<> next;
+    {
+        std::lock_guard<std::mutex> guard{lock.m};
+        if (lock.waiting.empty()) {
+            lock.held = false;
+            return;
+        }
+        // still held, now by the coroutine resumed
+        next = lock.waiting.front();
+        lock.waiting.pop_front();
+    }
+    schedule(next);
+}
+
+Reactor::Stream::Stream(Reactor &reactor, int fd): reactor{reactor}, fd{fd}, registered{false},
+    buffer(READ_SIZE), begin{0}, end{0} {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+Reactor::Stream::~Stream() {
+    if (registered) {
+        epoll_ctl(reactor.epollfd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+}
+
+ssize_t Reactor::Stream::Fill(size_t want) {
+    if (begin == end) {
+        begin = end = 0;
+    } else if (buffer.size() - begin < want) {
+        memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+    }
+    if (buffer.size() < want) {
+        buffer.resize(want);
+    }
+    ssize_t n = read(fd, buffer.data() + end, buffer.size() - end);
+    if (n > 0) {
+        end += n;
+    }
+    return n;
+}
+
+void Reactor::Stream::Readable::await_suspend(std::coroutine_handle<> handle) {
+    // once registered, the coroutine may resume on another thread and end
+    // before epoll_ctl returns: nothing of the stream is touched after it
+    int op = stream.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    int epollfd = stream.reactor.epollfd;
+    int fd = stream.fd;
+    stream.registered = true;
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = handle.address();
+    epoll_ctl(epollfd, op, fd, &event);
+}
@@ -0,0 +1,119 @@
+// This file contains the reactor serving connections as coroutines, with
+// ENGINE_REACTOR_THREADS set, rather than one thread each.
+//
+// A connection is a coroutine that reads its inputs as the thread of a
+// connection does, one frame after the other, but awaits its socket instead
+// of blocking in a read. The reactor's threads wait on all sockets at once
+// (epoll) and resume whichever connection has something to read, so a few
+// threads serve any number of connections. A connection also awaits the
+// books its next frame goes to: while another connection has one of them, it
+// waits in that book's list and the reactor's thread serves other
+// connections, until the one before it lets go and hands the book over.
+//
+// A coroutine runs on one reactor thread at a time but may resume on any of
+// them, so nothing tied to a thread (an epoch guard, a thread_local) may be
+// held across a co_await.
+
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <sys/types.h>
+#include <vector>
+
+class Reactor {
+    int epollfd;
+    int wakefd; // an eventfd, written to wake a thread asleep in epoll_wait
+    std::mutex m;
+    std::deque<std::coroutine_handle<>> ready;
+    uint32_t sleeping; // threads in epoll_wait with nothing ready, under m
+
+    Reactor(int epollfd, int wakefd): epollfd{epollfd}, wakefd{wakefd}, m{}, ready{}, sleeping{0} {}
+    void schedule(std::coroutine_handle<>);
+    void run();
+
+public:
+    // A coroutine nobody waits for: it starts once handed to Start and frees
+    // itself when it returns.
+    struct Task {
+        struct promise_type {
+            Task get_return_object() { return Task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    // A socket read without blocking, through a buffer of its own.
+    class Stream {
+        Reactor &reactor;
+        int fd;
+        bool registered;
+        std::vector<char> buffer;
+        size_t begin, end;
+
+    public:
+        Stream(Reactor &, int fd);
+        ~Stream();
+        Stream(const Stream &) = delete;
+        Stream &operator=(const Stream &) = delete;
+
+        size_t Buffered() const { return end - begin; }
+        const char *Data() const { return buffer.data() + begin; }
+        void Consume(size_t n) { begin += n; }
+        // reads what the socket has, for at least want bytes buffered; as read():
+        // 0 at the end, -1 with errno EAGAIN if there is nothing yet
+        ssize_t Fill(size_t want);
+
+        // resumes the coroutine once the socket can be read
+        struct Readable {
+            Stream &stream;
+            bool await_ready() { return false; }
+            void await_suspend(std::coroutine_handle<>);
+            void await_resume() {}
+        };
+        Readable Wait() { return Readable{*this}; }
+    };
+
+    // A lock held by a coroutine rather than a thread, across its co_awaits.
+    // A coroutine that finds it held waits in its list, without a thread.
+    class Lock {
+        friend class Reactor;
+        std::mutex m;
+        bool held; // under m, as waiting
+        std::deque<std::coroutine_handle<>> waiting;
+
+    public:
+        Lock(): m{}, held{false}, waiting{} {}
+        Lock(const Lock &) = delete;
+        Lock &operator=(const Lock &) = delete;
+    };
+
+    // resumes the coroutine holding the lock: at once if it is free, else
+    // once Unlock hands it over
+    struct Locking {
+        Reactor &reactor;
+        Lock &lock;
+        bool await_ready();
+        bool await_suspend(std::coroutine_handle<>);
+        void await_resume() {}
+    };
+    Locking Acquire(Lock &lock) { return Locking{*this, lock}; }
+    // to the first coroutine waiting, if any, which is scheduled
+    void Unlock(Lock &);
+
+    // starts the reactor's threads; null if there is no epoll
+    static Reactor *Create(uint32_t threads);
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+
+    void Start(Task task) { schedule(task.handle); }
+};
+
+#endif
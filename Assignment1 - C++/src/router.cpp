@@ -0,0 +1,458 @@
+// This file contains the router, which spreads instruments over several
+// engine processes.
+//
+//     router <socket path> <shards> [<engine path>]
+//
+// The router starts the engines itself, shard i listening on
+// "<socket path>.<i>" with its output piped back to the router. Clients
+// connect to the router exactly as they would to an engine. Each client
+// connection gets a connection of its own to every shard, so a mass cancel
+// or a disconnect still concerns the client's orders only:
+//
+// - buys, sells and depth queries go to the shard of their instrument, a
+//   hash of its name;
+// - cancels and amends go to the shard the order was sent to, looked up by
+//   order id (unknown ids, and orders that have left the book, go to shard
+//   0, which rejects them);
+// - a mass cancel goes to every shard.
+//
+// The shards' output is merged on the router's stdout. Each shard's lines
+// stay in the order the shard wrote them; between shards, the line with the
+// oldest output timestamp goes first, the timestamps all coming from the
+// same monotonic clock. A line is written once every shard has written a
+// later one, or once it is ROUTER_MERGE_WINDOW_US old (2000 by default),
+// whichever comes first: a quiet shard delays the stream by at most that
+// much, and a shard whose lines take longer than that to reach the router
+// can have them written after a later line of another shard. The router
+// says so on stderr when that happens.
+//
+// The engine settings naming a file or socket (ENGINE_MD_PATH,
+// ENGINE_STATS_PATH, ENGINE_TRACE_PATH) get ".<i>" appended for shard i.
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "hashmap.hpp"
+#include "io.h"
+
+static std::string socketPath;
+static int listenfd = -1;
+static std::vector<pid_t> engines;
+static std::vector<std::string> shardPaths;
+
+// An order the router has sent on: the shard it went to, and its count then.
+struct Route {
+    uint32_t shard;
+    uint32_t count;
+};
+
+// order id to its route, until the order has left the book; the engine's
+// default table is sized for a few books, this one holds every live order
+static HashMap<uint32_t, Route> shardOfOrder{262147};
+
+static int64_t Now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+static uint32_t ShardOf(const char *instrument) {
+    // FNV-1a, the same on every run, unlike std::hash
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(input::instrument) && instrument[i] != '\0'; i++) {
+        hash = (hash ^ static_cast<unsigned char>(instrument[i])) * 16777619u;
+    }
+    return hash % shardPaths.size();
+}
+
+// The merged output. Every shard's lines wait in a queue of their own, in
+// the order the shard wrote them; the next line out is the oldest of the
+// lines at the front of the queues. Each shard's newest timestamp says how
+// far that shard has got.
+class Merger {
+    struct Line {
+        int64_t time;
+        std::string text;
+    };
+
+    std::mutex m;
+    std::condition_variable added;
+    std::vector<std::deque<Line>> queues;
+    size_t waiting; // lines in all queues
+    std::vector<int64_t> reached;
+    int64_t window;
+    // the last line written, and how many lines were written after a later
+    // line of another shard
+    int64_t written;
+    size_t writtenBy;
+    uint64_t backwards;
+
+    // the shard whose next line is the oldest; under m, with lines waiting
+    size_t oldest() const {
+        size_t next = queues.size();
+        for (size_t i = 0; i < queues.size(); i++) {
+            if (!queues[i].empty() && (next == queues.size() || queues[i].front().time < queues[next].front().time)) {
+                next = i;
+            }
+        }
+        return next;
+    }
+
+    // under m
+    void write(size_t shard) {
+        Line &line = queues[shard].front();
+        if (line.time < written && shard != writtenBy) {
+            backwards++;
+            fprintf(stderr, "Router: a line of shard %zu stamped %" PRId64 " was written after one of shard %zu "
+                    "stamped %" PRId64 " (%" PRIu64 " so far), ROUTER_MERGE_WINDOW_US is too short\n", shard,
+                    line.time, writtenBy, written, backwards);
+        }
+        written = line.time;
+        writtenBy = shard;
+        fputs(line.text.c_str(), stdout);
+        queues[shard].pop_front();
+        waiting--;
+    }
+
+public:
+    Merger(size_t shards, int64_t window): m{}, added{}, queues(shards), waiting{0}, reached(shards, 0),
+        window{window}, written{0}, writtenBy{0}, backwards{0} {}
+
+    void Add(size_t shard, std::string text) {
+        // the output timestamp is the last field of every line
+        size_t space = text.find_last_of(' ');
+        int64_t time = space == std::string::npos ? 0 : strtoll(text.c_str() + space + 1, nullptr, 10);
+        std::lock_guard<std::mutex> lock{m};
+        reached[shard] = std::max(reached[shard], time);
+        queues[shard].push_back(Line{time, std::move(text)});
+        waiting++;
+        added.notify_one();
+    }
+
+    void Run() {
+        std::unique_lock<std::mutex> lock{m};
+        while (true) {
+            if (waiting == 0) {
+                added.wait(lock);
+                continue;
+            }
+            size_t next = oldest();
+            int64_t time = queues[next].front().time;
+            int64_t behind = *std::min_element(reached.begin(), reached.end());
+            int64_t due = time + window;
+            if (time > behind && Now() < due) {
+                added.wait_for(lock, std::chrono::microseconds{due - Now()});
+                continue;
+            }
+            write(next);
+            if (waiting == 0) {
+                fflush(stdout);
+            }
+        }
+    }
+
+    // writes out whatever is waiting, when the router exits
+    void Drain() {
+        std::lock_guard<std::mutex> lock{m};
+        while (waiting != 0) {
+            write(oldest());
+        }
+        fflush(stdout);
+    }
+};
+
+static Merger *merger = nullptr;
+
+// Follows a shard's orders through its output, to forget the route of an
+// order once it has left the book, filled or cancelled.
+class OrderTracker {
+    // unfilled count of the orders that showed up in the output
+    std::unordered_map<uint32_t, uint32_t> remaining;
+
+    uint32_t *find(uint32_t id) {
+        auto it = remaining.find(id);
+        if (it == remaining.end()) {
+            Route route;
+            if (!shardOfOrder.get(id, route)) {
+                return nullptr;
+            }
+            it = remaining.emplace(id, route.count).first;
+        }
+        return &it->second;
+    }
+
+    void forget(uint32_t id) {
+        remaining.erase(id);
+        shardOfOrder.remove(id);
+    }
+
+    void fill(uint32_t id, uint32_t count) {
+        uint32_t *left = find(id);
+        if (left == nullptr) {
+            return;
+        }
+        *left -= std::min(*left, count);
+        if (*left == 0) {
+            forget(id);
+        }
+    }
+
+public:
+    void Line(const char *text) {
+        uint32_t id, other, count;
+        char type, accepted;
+        if (sscanf(text, "E %" SCNu32 " %" SCNu32 " %*u %*u %" SCNu32, &id, &other, &count) == 3) {
+            fill(id, count);
+            fill(other, count);
+        } else if (sscanf(text, "%c %" SCNu32 " %*s %*u %" SCNu32, &type, &id, &count) == 3 &&
+                   (type == 'B' || type == 'S')) {
+            // the part that did not fill rests
+            if (uint32_t *left = find(id)) {
+                *left = count;
+            }
+        } else if (sscanf(text, "X %" SCNu32 " %c", &id, &accepted) == 2 && accepted == 'A') {
+            forget(id);
+        } else if (sscanf(text, "A %" SCNu32 " %c %*u %" SCNu32, &id, &accepted, &count) == 3 &&
+                   accepted == 'A') {
+            if (uint32_t *left = find(id)) {
+                *left = count;
+            }
+        }
+    }
+};
+
+static void ShardOutput(size_t shard, FILE *output) {
+    OrderTracker orders;
+    char *buffer = nullptr;
+    size_t size = 0;
+    while (getline(&buffer, &size, output) != -1) {
+        orders.Line(buffer);
+        merger->Add(shard, buffer);
+    }
+}
+
+static FILE *ConnectShard(const std::string &path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    if (fd == -1 || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return nullptr;
+    }
+    FILE *shard = fdopen(fd, "w");
+    setvbuf(shard, nullptr, _IOFBF, BUFSIZ);
+    return shard;
+}
+
+static void ClientThread(FILE *client) {
+    std::vector<FILE *> shards;
+    for (auto &path : shardPaths) {
+        FILE *shard = ConnectShard(path);
+        if (shard == nullptr) {
+            std::cerr << "Cannot connect to shard " << path << std::endl;
+            for (FILE *open : shards) {
+                fclose(open);
+            }
+            fclose(client);
+            return;
+        }
+        shards.push_back(shard);
+    }
+
+    // a batch frame is split into one frame per shard, in the same order
+    std::vector<input> frame;
+    std::vector<std::vector<input>> routed(shards.size());
+    while (true) {
+        input first;
+        if (fread(&first, sizeof(first), 1, client) != 1) {
+            break;
+        }
+        frame.assign(1, first);
+        if (first.type == input_batch) {
+            if (first.count > INPUT_BATCH_MAX) {
+                std::cerr << "Error reading input" << std::endl;
+                break;
+            }
+            frame.resize(first.count);
+            if (fread(frame.data(), sizeof(input), frame.size(), client) != frame.size()) {
+                break;
+            }
+        }
+
+        for (auto &in : frame) {
+            uint32_t shard = 0;
+            switch (in.type) {
+                case input_buy:
+                case input_sell:
+                    shard = ShardOf(in.instrument);
+                    shardOfOrder.put(in.order_id, Route{shard, in.count});
+                    break;
+                case input_depth:
+                    shard = ShardOf(in.instrument);
+                    break;
+                case input_cancel:
+                case input_amend: {
+                    Route route{0, 0};
+                    if (shardOfOrder.get(in.order_id, route)) {
+                        shard = route.shard;
+                    }
+                    break;
+                }
+                case input_mass_cancel:
+                    for (auto &inputs : routed) {
+                        inputs.push_back(in);
+                    }
+                    continue;
+                case input_batch:
+                    // batch frames do not nest, the engine says so
+                    break;
+            }
+            routed[shard].push_back(in);
+        }
+
+        for (size_t i = 0; i < shards.size(); i++) {
+            auto &inputs = routed[i];
+            if (inputs.empty()) {
+                continue;
+            }
+            if (inputs.size() > 1) {
+                input header{};
+                header.type = input_batch;
+                header.count = static_cast<uint32_t>(inputs.size());
+                fwrite(&header, sizeof(header), 1, shards[i]);
+            }
+            fwrite(inputs.data(), sizeof(input), inputs.size(), shards[i]);
+            fflush(shards[i]);
+            inputs.clear();
+        }
+    }
+
+    for (FILE *shard : shards) {
+        fclose(shard);
+    }
+    fclose(client);
+}
+
+static void StartEngine(const char *engine, size_t shard, int output) {
+    for (const char *name : {"ENGINE_MD_PATH", "ENGINE_STATS_PATH", "ENGINE_TRACE_PATH"}) {
+        const char *value = getenv(name);
+        if (value != nullptr && *value != '\0') {
+            setenv(name, (std::string{value} + "." + std::to_string(shard)).c_str(), 1);
+        }
+    }
+    dup2(output, STDOUT_FILENO);
+    execl(engine, engine, shardPaths[shard].c_str(), static_cast<char *>(nullptr));
+    perror("exec");
+    _exit(1);
+}
+
+static void handle_exit_signal(int) {
+    exit(0);
+}
+
+static void exit_cleanup() {
+    for (pid_t pid : engines) {
+        kill(pid, SIGTERM);
+    }
+    if (merger != nullptr) {
+        merger->Drain();
+    }
+    if (listenfd != -1) {
+        close(listenfd);
+        unlink(socketPath.c_str());
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || atoi(argv[2]) < 1) {
+        std::cerr << "Usage: " << argv[0] << " <socket path> <shards> [<engine path>]" << std::endl;
+        return 1;
+    }
+    socketPath = argv[1];
+    size_t count = atoi(argv[2]);
+    const char *engine = argc > 3 ? argv[3] : "./engine";
+
+    atexit(exit_cleanup);
+    signal(SIGINT, handle_exit_signal);
+    signal(SIGTERM, handle_exit_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    const char *window = getenv("ROUTER_MERGE_WINDOW_US");
+    merger = new Merger{count, window != nullptr && *window != '\0' ? atoll(window) : 2000};
+    for (size_t i = 0; i < count; i++) {
+        shardPaths.push_back(socketPath + "." + std::to_string(i));
+    }
+    for (size_t i = 0; i < count; i++) {
+        int pipefd[2];
+        if (pipe(pipefd) != 0) {
+            perror("pipe");
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pipefd[0]);
+            StartEngine(engine, i, pipefd[1]);
+        }
+        close(pipefd[1]);
+        if (pid == -1) {
+            perror("fork");
+            return 1;
+        }
+        engines.push_back(pid);
+        std::thread{ShardOutput, i, fdopen(pipefd[0], "r")}.detach();
+    }
+    std::thread{&Merger::Run, merger}.detach();
+
+    // the engines take a moment to listen
+    for (auto &path : shardPaths) {
+        FILE *probe = nullptr;
+        for (int tries = 0; tries < 100 && (probe = ConnectShard(path)) == nullptr; tries++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds{20});
+        }
+        if (probe == nullptr) {
+            std::cerr << "Shard " << path << " is not listening" << std::endl;
+            return 1;
+        }
+        fclose(probe);
+    }
+
+    listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    if (listenfd == -1 || bind(listenfd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listenfd, 8) != 0) {
+        perror("listen");
+        return 1;
+    }
+
+    while (true) {
+        int connfd = accept(listenfd, nullptr, nullptr);
+        if (connfd == -1) {
+            perror("accept");
+            return 1;
+        }
+        FILE *client = fdopen(connfd, "r");
+        setvbuf(client, nullptr, _IOFBF, BUFSIZ);
+        std::thread{ClientThread, client}.detach();
+    }
+}
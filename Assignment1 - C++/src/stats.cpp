@@ -0,0 +1,69 @@
+#include "stats.hpp"
+
+#include <bit>
+
+std::atomic<Stats::Record*> Stats::records{nullptr};
+thread_local Stats::Record *Stats::local{nullptr};
+
+Stats::Record &Stats::self() {
+    // the record of this thread, returned to the pool when the thread exits
+    static thread_local struct Slot {
+        Record *record;
+
+        Slot(): record{nullptr} {
+            for (Record *r = records.load(); r != nullptr; r = r->next) {
+                bool free = false;
+                if (r->in_use.compare_exchange_strong(free, true)) {
+                    record = r;
+                    return;
+                }
+            }
+            record = new Record{};
+            record->next = records.load();
+            while (!records.compare_exchange_weak(record->next, record)) {
+            }
+        }
+        ~Slot() {
+            local = nullptr;
+            record->in_use.store(false);
+        }
+    } slot;
+    local = slot.record;
+    return *slot.record;
+}
+
+void Stats::Latency(int64_t micros) {
+    Record &record = local != nullptr ? *local : self();
+    int bucket = std::bit_width(static_cast<uint64_t>(micros < 0 ? 0 : micros));
+    bump<uint64_t>(record.latency[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1], 1);
+}
+
+Stats::Totals Stats::Read() {
+    Totals totals{};
+    for (Record *r = records.load(); r != nullptr; r = r->next) {
+        for (int i = 0; i < COUNTERS; i++) {
+            totals.counters[i] += r->counters[i].load(std::memory_order_relaxed);
+        }
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            totals.latency[i] += r->latency[i].load(std::memory_order_relaxed);
+        }
+    }
+    return totals;
+}
+
+int64_t Stats::Percentile(const Totals &totals, double fraction) {
+    uint64_t samples = 0;
+    for (uint64_t count : totals.latency) {
+        samples += count;
+    }
+    // the upper bound of the bucket holding the sample at that rank
+    uint64_t rank = static_cast<uint64_t>(fraction * samples);
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += totals.latency[i];
+        if (seen > rank) {
+            return i == 0 ? 0 : (int64_t{1} << i) - 1;
+        }
+    }
+    return 0;
+}
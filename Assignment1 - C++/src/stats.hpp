@@ -0,0 +1,76 @@
+// This file contains the engine's live counters, served on the stats socket.
+//
+// Every thread counts into a record of its own, with a relaxed load and
+// store on a cache line no other thread writes, so counting costs about as
+// much as incrementing a local. A read adds up the records of all threads.
+// Records are reused, never freed: a thread that exits leaves its counts to
+// the next thread taking its record over, so totals never go back.
+
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <atomic>
+#include <cstdint>
+
+class Stats {
+public:
+    enum Counter {
+        Inputs,
+        Orders,         // buys and sells
+        Cancels,
+        Amends,
+        MassCancels,
+        DepthQueries,
+        Executions,
+        Connections,    // open now: counted up on connect, down on disconnect
+        Retired,        // orders and levels handed to the epoch scheme
+        Freed,          // and freed by it since
+        COUNTERS
+    };
+    // input latencies in microseconds, bucket b holding those of bit width b
+    static constexpr int LATENCY_BUCKETS = 32;
+    // only one input in this many is timed, a clock read is not free
+    static constexpr uint64_t LATENCY_SAMPLE = 16;
+
+    struct Totals {
+        int64_t counters[COUNTERS];
+        uint64_t latency[LATENCY_BUCKETS];
+    };
+
+private:
+    struct alignas(64) Record {
+        std::atomic<int64_t> counters[COUNTERS];
+        std::atomic<uint64_t> latency[LATENCY_BUCKETS];
+        std::atomic<bool> in_use;
+        Record *next;
+
+        Record(): counters{}, latency{}, in_use{true}, next{nullptr} {}
+    };
+
+    static std::atomic<Record*> records;
+    static thread_local Record *local;
+    static Record &self();
+
+    template <typename T> static void bump(std::atomic<T> &counter, T n) {
+        // only this thread writes its record
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+public:
+    static void Count(Counter counter, int64_t n = 1) {
+        Record &record = local != nullptr ? *local : self();
+        bump(record.counters[counter], n);
+    }
+    // whether the input this thread is about to handle should be timed
+    static bool Sampled() {
+        Record &record = local != nullptr ? *local : self();
+        return record.counters[Inputs].load(std::memory_order_relaxed) % LATENCY_SAMPLE == 0;
+    }
+    static void Latency(int64_t micros);
+
+    static Totals Read();
+    // smallest latency at or above the given fraction of the samples
+    static int64_t Percentile(const Totals &, double fraction);
+};
+
+#endif
@@ -0,0 +1,115 @@
+#include "trace.hpp"
+
+#ifdef ENGINE_TRACE
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+uint32_t Trace::sample{0};
+std::string Trace::path{};
+std::atomic<Trace::Ring*> Trace::rings{nullptr};
+std::atomic<uint32_t> Trace::threads{0};
+thread_local Trace::Ring *Trace::local{nullptr};
+
+// the counter and the clock when tracing started, to turn ticks into time
+static uint64_t start_tsc;
+static std::chrono::steady_clock::time_point start_time;
+
+static const char *const STAGE_NAMES[] = {"read", "dispatch", "lock", "match", "add", "output", "done", "fill"};
+static_assert(sizeof(STAGE_NAMES) / sizeof(STAGE_NAMES[0]) == Trace::STAGES);
+
+uint64_t Trace::Now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void Trace::Configure(const std::string &trace_path, uint32_t trace_sample) {
+    path = trace_path;
+    sample = trace_sample;
+    start_tsc = Now();
+    start_time = std::chrono::steady_clock::now();
+    if (sample != 0) {
+        std::atexit(dump);
+    }
+}
+
+Trace::Ring &Trace::self() {
+    if (local == nullptr) {
+        // zeroed, there is no constructor to run over a megabyte of events
+        local = static_cast<Ring *>(calloc(1, sizeof(Ring)));
+        local->thread = ++threads;
+        local->next = rings.load();
+        while (!rings.compare_exchange_weak(local->next, local)) {
+        }
+    }
+    return *local;
+}
+
+void Trace::record(uint32_t order_id, Stage stage) {
+    Ring &ring = self();
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    ring.events[head % CAPACITY] = Event{order_id, stage, Now()};
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+void Trace::dump() {
+    struct Slice {
+        uint32_t order_id;
+        Stage stage;
+        uint64_t tsc;
+        uint32_t thread;
+    };
+    std::vector<Slice> slices;
+    for (Ring *ring = rings.load(); ring != nullptr; ring = ring->next) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        for (uint64_t i = head > CAPACITY ? head - CAPACITY : 0; i < head; i++) {
+            const Event &event = ring->events[i % CAPACITY];
+            slices.push_back({event.order_id, event.stage, event.tsc, ring->thread});
+        }
+    }
+    // an order's stages in the order it went through them, whichever threads
+    std::sort(slices.begin(), slices.end(), [](const Slice &a, const Slice &b) {
+        return a.order_id != b.order_id ? a.order_id < b.order_id : a.tsc < b.tsc;
+    });
+
+    double elapsed_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start_time).count();
+    double ticks_per_us = elapsed_us > 0 ? (Now() - start_tsc) / elapsed_us : 1;
+
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        std::cerr << "Cannot write trace " << path << std::endl;
+        return;
+    }
+    fprintf(file, "{\"traceEvents\": [\n");
+    for (size_t i = 0; i < slices.size(); i++) {
+        const Slice &slice = slices[i];
+        double ts = (slice.tsc - start_tsc) / ticks_per_us;
+        // an input ends at done, and a fill while the order rests belongs to
+        // another order's input: both are marks rather than spans
+        bool last = i + 1 == slices.size() || slices[i + 1].order_id != slice.order_id ||
+                    slice.stage == Done || slice.stage == Fill || slices[i + 1].stage == Read ||
+                    slices[i + 1].stage == Fill;
+        double dur = last ? 0 : (slices[i + 1].tsc - slice.tsc) / ticks_per_us;
+        fprintf(file,
+                "%s{\"name\": \"%s\", \"cat\": \"order\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                "\"pid\": 1, \"tid\": %" PRIu32 ", \"args\": {\"order_id\": %" PRIu32 "}}",
+                i == 0 ? "" : ",\n", STAGE_NAMES[slice.stage], ts, dur, slice.thread, slice.order_id);
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+}
+
+#endif
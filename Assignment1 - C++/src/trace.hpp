@@ -0,0 +1,83 @@
+// This file contains the order lifecycle trace, built in with -DENGINE_TRACE
+// (make TRACE=1) and compiled out otherwise.
+//
+// A trace point records that an order reached a stage: the order id, the
+// stage and the time stamp counter go into a ring of the calling thread.
+// Only ids that are a multiple of ENGINE_TRACE_SAMPLE are traced, so the
+// rings keep the whole life of the orders they hold. When the engine exits
+// the rings are written to ENGINE_TRACE_PATH in the Chrome trace event
+// format (chrome://tracing, Perfetto): one slice per stage, lasting until
+// the order reached its next stage within the same input, on the track of
+// the thread that got there. The trace is read while other threads may
+// still be writing, the last few events of a thread can be torn.
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#ifdef ENGINE_TRACE
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+class Trace {
+public:
+    enum Stage : uint32_t {
+        Read,       // the input came off the connection
+        Dispatch,   // handling starts, with the book lookup
+        Lock,       // the book's locks are wanted
+        Match,      // all locks held, matching starts
+        Add,        // what is left joins the book
+        Output,     // a line about the order is written
+        Done,       // the input is handled
+        Fill,       // resting, it was filled by another order's input
+        STAGES
+    };
+
+private:
+    struct Event {
+        uint32_t order_id;
+        Stage stage;
+        uint64_t tsc;
+    };
+    static constexpr uint64_t CAPACITY = 1 << 16;
+
+    struct Ring {
+        Event events[CAPACITY];
+        std::atomic<uint64_t> head; // events written, the last CAPACITY are kept
+        uint32_t thread;
+        Ring *next;
+    };
+
+    static uint32_t sample;
+    static std::string path;
+    // every ring ever made; threads keep theirs until the engine exits
+    static std::atomic<Ring*> rings;
+    static std::atomic<uint32_t> threads;
+    static thread_local Ring *local;
+
+    static Ring &self();
+    static void record(uint32_t order_id, Stage stage);
+    static void dump();
+
+public:
+    // reads the settings and arranges for the dump at exit; before any trace point
+    static void Configure(const std::string &path, uint32_t sample);
+    static uint64_t Now();
+
+    static void Point(uint32_t order_id, Stage stage) {
+        if (sample != 0 && order_id % sample == 0 && order_id != 0) {
+            record(order_id, stage);
+        }
+    }
+};
+
+#define TRACE_POINT(order_id, stage) Trace::Point((order_id), Trace::stage)
+
+#else
+
+#define TRACE_POINT(order_id, stage) do {} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,192 @@
+#include "writer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static constexpr size_t PAGE = 4096;
+
+struct OutputWriter::Buffer {
+    char *data;
+    size_t size;
+};
+
+// m guards the buffers being filled, write_m the descriptor and the turn of
+// the batches. A flush takes the filled buffers and a ticket under m and lets
+// go of it before waiting for its turn under write_m, so appends never wait
+// for a writev, and batches are written in the order of their tickets. No
+// thread waits for write_m holding m; pool_m is taken last, under either.
+// Once BATCH buffers are filled, full wakes the writer thread to flush them.
+struct OutputWriter::State {
+    std::mutex m;
+    Buffer current;
+    std::vector<Buffer> filled;
+    uint64_t tickets; // under m
+    std::condition_variable full;
+    std::mutex write_m;
+    std::condition_variable turn;
+    uint64_t serving; // ticket written next, under write_m
+    std::vector<iovec> iov;
+    int fd;
+    std::mutex pool_m;
+    std::vector<char *> pool;
+};
+
+OutputWriter::State &OutputWriter::state() {
+    // never destroyed: threads still write while the engine exits
+    static State *state = new State{{}, {nullptr, 0}, {}, 0, {}, {}, {}, 0, {}, STDOUT_FILENO, {}, {}};
+    return *state;
+}
+
+static char *AllocateBuffer(size_t size) {
+    char *data = static_cast<char *>(aligned_alloc(PAGE, size));
+    if (data == nullptr) {
+        throw std::bad_alloc{};
+    }
+    return data;
+}
+
+void OutputWriter::Configure() {
+    State &s = state();
+    {
+        std::lock_guard<std::mutex> lock{s.pool_m};
+        for (size_t i = 0; i < POOL; i++) {
+            // touched now, so the first lines do not fault the pages in
+            char *data = AllocateBuffer(BUFFER);
+            memset(data, 0, BUFFER);
+            s.pool.push_back(data);
+        }
+    }
+    std::atexit(Flush);
+    std::thread writer{&OutputWriter::drain};
+    writer.detach();
+}
+
+void OutputWriter::drain() {
+    State &s = state();
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock{s.m};
+            s.full.wait(lock, [&] { return s.filled.size() >= BATCH; });
+        }
+        Flush();
+    }
+}
+
+void OutputWriter::Redirect(int fd) {
+    Flush();
+    State &s = state();
+    std::lock_guard<std::mutex> writing{s.write_m};
+    s.fd = fd;
+}
+
+char *OutputWriter::take(State &s) {
+    std::lock_guard<std::mutex> lock{s.pool_m};
+    if (s.pool.empty()) {
+        return AllocateBuffer(BUFFER);
+    }
+    char *data = s.pool.back();
+    s.pool.pop_back();
+    return data;
+}
+
+void OutputWriter::Append(const char *line, size_t size) {
+    State &s = state();
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock{s.m};
+        // a line that does not fit goes on in the next buffer, they are written in order
+        while (size > 0) {
+            if (s.current.data == nullptr) {
+                s.current = Buffer{take(s), 0};
+            }
+            size_t n = std::min(size, BUFFER - s.current.size);
+            memcpy(s.current.data + s.current.size, line, n);
+            s.current.size += n;
+            line += n;
+            size -= n;
+            if (s.current.size == BUFFER) {
+                s.filled.push_back(s.current);
+                s.current = Buffer{nullptr, 0};
+            }
+        }
+        full = s.filled.size() >= BATCH;
+    }
+    // not written here: the caller may hold the locks of a book
+    if (full) {
+        s.full.notify_one();
+    }
+}
+
+void OutputWriter::Flush() {
+    State &s = state();
+    std::vector<Buffer> batch;
+    uint64_t ticket;
+    {
+        std::lock_guard<std::mutex> lock{s.m};
+        if (s.current.data != nullptr) {
+            s.filled.push_back(s.current);
+            s.current = Buffer{nullptr, 0};
+        }
+        if (s.filled.empty()) {
+            return;
+        }
+        // copied out, filled keeps its capacity for the appends
+        batch.assign(s.filled.begin(), s.filled.end());
+        s.filled.clear();
+        ticket = s.tickets++;
+    }
+
+    {
+        std::unique_lock<std::mutex> writing{s.write_m};
+        s.turn.wait(writing, [&] { return s.serving == ticket; });
+        s.iov.clear();
+        for (const Buffer &buffer : batch) {
+            s.iov.push_back(iovec{buffer.data, buffer.size});
+        }
+        // writev may stop short, on a signal or a full pipe: go on from there
+        for (size_t first = 0; first < s.iov.size();) {
+            int count = static_cast<int>(std::min<size_t>(s.iov.size() - first, IOV_MAX));
+            ssize_t n = writev(s.fd, s.iov.data() + first, count);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1) {
+                // nobody reads the output any more, the lines are dropped
+                break;
+            }
+            size_t left = n;
+            while (first < s.iov.size() && left >= s.iov[first].iov_len) {
+                left -= s.iov[first].iov_len;
+                first++;
+            }
+            if (first < s.iov.size()) {
+                s.iov[first].iov_base = static_cast<char *>(s.iov[first].iov_base) + left;
+                s.iov[first].iov_len -= left;
+            }
+        }
+        s.serving++;
+    }
+    s.turn.notify_all();
+
+    // the kernel has its copy, the buffers can be filled again; those made
+    // past the pool, while output came faster than it was written, are freed
+    std::lock_guard<std::mutex> pooling{s.pool_m};
+    for (const Buffer &buffer : batch) {
+        if (s.pool.size() < POOL) {
+            s.pool.push_back(buffer.data);
+        } else {
+            free(buffer.data);
+        }
+    }
+}
@@ -0,0 +1,81 @@
+// This file contains the writer behind Output: the engine's output lines, in
+// the order they were made, written out in batches.
+//
+// A line is formatted into a buffer of its thread, then copied once into
+// the writer's current buffer, under a lock. The engine makes its lines
+// while holding the locks of the book they are about, so the order of the
+// copies is the order of the events. Buffers are 64K, page-aligned, taken
+// from a pool that is made before the first input. Lines wait in them until
+// the thread handling a frame is done with it and flushes. Every buffer
+// filled since the last flush goes to the kernel in one writev and back to
+// the pool once writev returns, the kernel having copied it by then. When
+// many buffers wait, a thread of the writer's own flushes them, so the
+// thread appending never writes while it holds a book's locks; whatever
+// waits when the engine exits is written then.
+
+#ifndef WRITER_HPP
+#define WRITER_HPP
+
+#include <charconv>
+#include <concepts>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+class OutputWriter {
+    static constexpr size_t BUFFER = 64 << 10;
+    // filled buffers after which the writer thread flushes, rather than wait
+    // for a frame
+    static constexpr size_t BATCH = 16;
+    // a batch being written, the next one filling and the current buffer
+    static constexpr size_t POOL = 2 * BATCH + 1;
+
+    struct Buffer;
+    struct State;
+    static State &state();
+    static char *take(State &);
+    // the writer thread
+    static void drain();
+
+public:
+    // makes the pool and arranges for the flush at exit; before the first line
+    static void Configure();
+    // where the lines go from now on, stdout by default
+    static void Redirect(int fd);
+    static void Append(const char *line, size_t size);
+    // writes every line appended so far, from whichever thread
+    static void Flush();
+};
+
+// A line being formatted, into a buffer its thread reuses.
+class OutputLine {
+    std::string &text;
+
+    static std::string &buffer() {
+        static thread_local std::string line;
+        return line;
+    }
+
+public:
+    OutputLine(): text{buffer()} { text.clear(); }
+    OutputLine(const OutputLine &) = delete;
+    OutputLine &operator=(const OutputLine &) = delete;
+
+    OutputLine &operator<<(std::string_view s) {
+        text.append(s);
+        return *this;
+    }
+    OutputLine &operator<<(char c) {
+        text.push_back(c);
+        return *this;
+    }
+    template <std::integral T> OutputLine &operator<<(T n) {
+        char digits[24];
+        text.append(digits, std::to_chars(digits, digits + sizeof(digits), n).ptr);
+        return *this;
+    }
+
+    void Write() { OutputWriter::Append(text.data(), text.size()); }
+};
+
+#endif
@@ -0,0 +1,775 @@
+// Streaming replacement for checker.py.
+//
+// Replays the engine output (sorted by output timestamp) against a
+// reference book built from the input log, with the same pass/fail rules
+// as checker.py. Both files are streamed: input lines are only read as far
+// as the output refers to them, and output lines are put back into
+// timestamp order within a bounded reorder window, so memory is bounded
+// by the live orders rather than by the size of the logs.
+//
+// Usage: checker [input.txt] [output.txt] [--window-us N] [--timing]
+// Either file may be "-" for stdin. --timing reports the bytes read and the
+// throughput on stderr. `make check` runs it and checker.py on the logs in
+// fixtures/ and compares their verdicts.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// Reads whole lines out of a large buffer, refilled with read(2).
+class LineReader {
+  static constexpr size_t BUFFER_SIZE = 1 << 20;
+
+  int fd;
+  std::vector<char> buffer;
+  size_t begin{0};
+  size_t end{0};
+  bool eof{false};
+
+ public:
+  // by all readers, for --timing
+  static inline size_t bytes_read = 0;
+
+  explicit LineReader(const char *path) : buffer(BUFFER_SIZE) {
+    fd = std::string_view{path} == "-" ? 0 : open(path, O_RDONLY);
+    if (fd == -1) {
+      throw std::runtime_error(std::string{"cannot open "} + path);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  LineReader(const LineReader &) = delete;
+  LineReader &operator=(const LineReader &) = delete;
+  ~LineReader() {
+    if (fd > 0) {
+      close(fd);
+    }
+  }
+
+  // The returned view is valid until the next call.
+  std::optional<std::string_view> next() {
+    while (true) {
+      const char *start = buffer.data() + begin;
+      if (auto *nl = static_cast<const char *>(
+              std::memchr(start, '\n', end - begin))) {
+        begin += nl - start + 1;
+        return std::string_view{start, static_cast<size_t>(nl - start)};
+      }
+      if (eof) {
+        if (begin == end) {
+          return std::nullopt;
+        }
+        std::string_view last{start, end - begin};
+        begin = end;
+        return last;
+      }
+      std::memmove(buffer.data(), start, end - begin);
+      end -= begin;
+      begin = 0;
+      if (end == buffer.size()) {
+        buffer.resize(buffer.size() * 2);
+      }
+      ssize_t n = read(fd, buffer.data() + end, buffer.size() - end);
+      if (n < 0) {
+        throw std::runtime_error("error reading input");
+      }
+      eof = n == 0;
+      end += n;
+      bytes_read += n;
+    }
+  }
+};
+
+// Splits a line on spaces and tabs. Every line of both logs goes through
+// here, so it scans the line once, by hand, and parses numbers in place.
+class Tokens {
+  const char *p;
+  const char *end;
+
+  static bool blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+  void skip_blanks() {
+    while (p != end && blank(*p)) {
+      ++p;
+    }
+  }
+
+ public:
+  explicit Tokens(std::string_view line)
+      : p{line.data()}, end{line.data() + line.size()} {}
+
+  std::optional<std::string_view> next() {
+    skip_blanks();
+    if (p == end) {
+      return std::nullopt;
+    }
+    return word();
+  }
+
+  std::string_view word() {
+    skip_blanks();
+    const char *start = p;
+    while (p != end && !blank(*p)) {
+      ++p;
+    }
+    if (p == start) {
+      throw std::runtime_error("expected token");
+    }
+    return std::string_view{start, static_cast<size_t>(p - start)};
+  }
+
+  template <typename T>
+  T number() {
+    skip_blanks();
+    const char *start = p;
+    T value = 0;
+    // the numbers of the logs are short and unsigned, and are read in the
+    // same pass that finds their end; anything else (and any error) is left
+    // to from_chars
+    for (; p != end && p - start < std::numeric_limits<T>::digits10; ++p) {
+      unsigned digit = static_cast<unsigned char>(*p) - '0';
+      if (digit > 9) {
+        break;
+      }
+      value = value * 10 + digit;
+    }
+    if (p != start && (p == end || blank(*p))) {
+      return value;
+    }
+    p = start;
+    auto token = word();
+    auto [ptr, ec] =
+        std::from_chars(token.data(), token.data() + token.size(), value);
+    if (ec != std::errc{} || ptr != token.data() + token.size()) {
+      throw std::runtime_error("expected integer, got '" +
+                               std::string{token} + "'");
+    }
+    return value;
+  }
+};
+
+// Instruments are at most 8 characters, so they fit in one word.
+uint64_t pack_instrument(std::string_view instrument) {
+  if (instrument.size() > 8) {
+    throw std::runtime_error("instrument too long: " +
+                             std::string{instrument});
+  }
+  uint64_t packed = 0;
+  std::memcpy(&packed, instrument.data(), instrument.size());
+  return packed;
+}
+
+// One engine output line, parsed as soon as it is read so that the
+// reorder window holds small fixed-size records rather than text.
+struct OutputEvent {
+  char type;
+  char cancel_status;
+  uint32_t order_id;  // resting order id for executions
+  uint32_t new_id;
+  uint32_t execution_id;
+  uint32_t price;
+  int64_t count;
+  uint64_t instrument;
+  int64_t input_time;
+  int64_t output_time;
+
+  static OutputEvent parse(std::string_view line) {
+    Tokens tokens{line};
+    OutputEvent e{};
+    e.type = tokens.word()[0];
+    switch (e.type) {
+      case 'E':
+        e.order_id = tokens.number<uint32_t>();
+        e.new_id = tokens.number<uint32_t>();
+        e.execution_id = tokens.number<uint32_t>();
+        e.price = tokens.number<uint32_t>();
+        e.count = tokens.number<int64_t>();
+        break;
+      case 'B':
+      case 'S':
+        e.order_id = tokens.number<uint32_t>();
+        e.instrument = pack_instrument(tokens.word());
+        e.price = tokens.number<uint32_t>();
+        e.count = tokens.number<int64_t>();
+        break;
+      case 'X': {
+        e.order_id = tokens.number<uint32_t>();
+        auto status = tokens.word();
+        e.cancel_status = status.size() == 1 ? status[0] : '?';
+        break;
+      }
+    }
+    e.input_time = tokens.number<int64_t>();
+    e.output_time = tokens.number<int64_t>();
+    return e;
+  }
+
+  friend std::ostream &operator<<(std::ostream &os, const OutputEvent &e) {
+    char instrument[9] = {};
+    std::memcpy(instrument, &e.instrument, 8);
+    switch (e.type) {
+      case 'E':
+        os << "E " << e.order_id << " " << e.new_id << " "
+           << e.execution_id << " " << e.price << " " << e.count;
+        break;
+      case 'B':
+      case 'S':
+        os << e.type << " " << e.order_id << " " << instrument << " "
+           << e.price << " " << e.count;
+        break;
+      case 'X':
+        os << "X " << e.order_id << " " << e.cancel_status;
+        break;
+    }
+    return os << " " << e.input_time << " " << e.output_time;
+  }
+};
+
+// An order's place in the book.
+struct Resting {
+  uint32_t price;
+  int64_t input_time;
+  uint64_t seq;
+  uint32_t order_id;
+};
+
+// One side of an instrument's book, in the same order as checker.py's
+// Order.__lt__: best price first, then earliest input timestamp. Ties
+// (which heapq breaks arbitrarily) are broken by arrival. Orders are kept
+// in price levels rather than one tree: a book holds many orders at few
+// prices, and levels are mostly appended to and taken from the front. An
+// order leaving from anywhere but the front is only marked, and dropped
+// once it gets to the front; the front of every level is always live.
+template <char Side>
+class BookSide {
+  struct Entry {
+    int64_t input_time;
+    uint64_t seq;
+    uint32_t order_id;
+    bool live;
+  };
+  using Level = std::deque<Entry>;
+  using Better = std::conditional_t<Side == 'B', std::greater<uint32_t>,
+                                    std::less<uint32_t>>;
+
+  std::map<uint32_t, Level, Better> levels;
+
+  static bool earlier(const Entry &a, const Entry &b) {
+    return a.input_time < b.input_time ||
+           (a.input_time == b.input_time && a.seq < b.seq);
+  }
+
+ public:
+  void insert(const Resting &key) {
+    auto &level = levels[key.price];
+    Entry entry{key.input_time, key.seq, key.order_id, true};
+    auto it = level.end();
+    if (!level.empty() && earlier(entry, level.back())) {
+      it = std::upper_bound(level.begin(), level.end(), entry, earlier);
+    }
+    level.insert(it, entry);
+  }
+
+  void erase(const Resting &key) {
+    auto level = levels.find(key.price);
+    if (level == levels.end()) {
+      return;
+    }
+    auto &entries = level->second;
+    // fills take orders from the front, only cancels need the search
+    auto it = entries.begin();
+    if (it->seq != key.seq) {
+      Entry entry{key.input_time, key.seq, key.order_id, true};
+      it = std::lower_bound(entries.begin(), entries.end(), entry, earlier);
+      if (it == entries.end() || it->seq != key.seq) {
+        return;
+      }
+    }
+    it->live = false;
+    while (!entries.empty() && !entries.front().live) {
+      entries.pop_front();
+    }
+    if (entries.empty()) {
+      levels.erase(level);
+    }
+  }
+
+  std::optional<uint32_t> best() const {
+    if (levels.empty()) {
+      return std::nullopt;
+    }
+    return levels.begin()->second.front().order_id;
+  }
+};
+
+struct InstrumentBook {
+  BookSide<'B'> buys;
+  BookSide<'S'> sells;
+};
+
+// Everything known about an order from the input log, plus its book and
+// its place in it once it has been booked.
+struct Order {
+  char type;
+  bool booked;
+  uint64_t instrument;
+  InstrumentBook *book;
+  int64_t count;          // remaining, as new order
+  int64_t resting_count;  // remaining, as resting order
+  Resting key;
+};
+
+// Open-addressing hash table from order id to Order, with linear probing
+// and backward-shift deletion. Lookups dominate the checker's run time.
+// Order ids are mostly handed out sequentially, so they are used as their
+// own hash: neighbouring ids then land in neighbouring slots, which keeps
+// the lookups of a replay mostly within a few hot cache lines.
+class OrderTable {
+  struct Slot {
+    uint32_t order_id;
+    bool used;
+    Order order;
+  };
+
+  std::vector<Slot> slots;
+  size_t mask;
+  size_t used{0};
+
+  size_t home(uint32_t order_id) const {
+    return order_id & mask;
+  }
+
+  void grow() {
+    std::vector<Slot> old(slots.size() * 2);
+    old.swap(slots);
+    mask = slots.size() - 1;
+    used = 0;
+    for (auto &slot : old) {
+      if (slot.used) {
+        insert_or_assign(slot.order_id, slot.order);
+      }
+    }
+  }
+
+ public:
+  OrderTable() : slots(1 << 16), mask{slots.size() - 1} {}
+
+  Order *find(uint32_t order_id) {
+    for (size_t i = home(order_id);; i = (i + 1) & mask) {
+      if (!slots[i].used) {
+        return nullptr;
+      }
+      if (slots[i].order_id == order_id) {
+        return &slots[i].order;
+      }
+    }
+  }
+
+  Order *insert_or_assign(uint32_t order_id, const Order &order) {
+    if ((used + 1) * 2 > slots.size()) {
+      grow();
+    }
+    size_t i = home(order_id);
+    for (; slots[i].used; i = (i + 1) & mask) {
+      if (slots[i].order_id == order_id) {
+        slots[i].order = order;
+        return &slots[i].order;
+      }
+    }
+    slots[i] = Slot{order_id, true, order};
+    used++;
+    return &slots[i].order;
+  }
+
+  void erase(uint32_t order_id) {
+    size_t i = home(order_id);
+    for (; slots[i].order_id != order_id; i = (i + 1) & mask) {
+      if (!slots[i].used) {
+        return;
+      }
+    }
+    if (!slots[i].used) {
+      return;
+    }
+    // Shift back any later entry of the probe chain that may not stay
+    // behind the hole.
+    for (size_t j = (i + 1) & mask; slots[j].used; j = (j + 1) & mask) {
+      size_t k = home(slots[j].order_id);
+      if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+        slots[i] = slots[j];
+        i = j;
+      }
+    }
+    slots[i].used = false;
+    used--;
+  }
+};
+
+// Reads the input log lazily, as far as the output needs it.
+class InputLog {
+  LineReader reader;
+  OrderTable orders;
+  size_t num_orders{0};
+  // the order of the line read last, if it was one
+  std::pair<uint32_t, Order *> last_read{0, nullptr};
+
+  bool read_one() {
+    last_read = {0, nullptr};
+    auto line = reader.next();
+    if (!line) {
+      return false;
+    }
+    Tokens tokens{*line};
+    auto type = tokens.next();
+    if (!type || type->size() != 1) {
+      return true;
+    }
+    switch ((*type)[0]) {
+      case 'C':
+        num_orders++;
+        break;
+      case 'B':
+      case 'S': {
+        num_orders++;
+        auto order_id = tokens.number<uint32_t>();
+        auto instrument = pack_instrument(tokens.word());
+        tokens.number<uint32_t>();  // price
+        auto count = tokens.number<int64_t>();
+        last_read = {order_id,
+                     orders.insert_or_assign(
+                         order_id, Order{(*type)[0], false, instrument,
+                                         nullptr, count, 0, {}})};
+        break;
+      }
+      default:
+        break;
+    }
+    return true;
+  }
+
+ public:
+  explicit InputLog(const char *path) : reader{path} {}
+
+  Order &at(uint32_t order_id) {
+    if (Order *order = orders.find(order_id)) {
+      return *order;
+    }
+    while (read_one()) {
+      if (last_read.second != nullptr && last_read.first == order_id) {
+        return *last_read.second;
+      }
+    }
+    throw std::runtime_error("order " + std::to_string(order_id) +
+                             " is not in the input");
+  }
+
+  // Only orders that are booked can be cancelled.
+  Order *find_booked(uint32_t order_id) {
+    Order *order = orders.find(order_id);
+    return order && order->booked ? order : nullptr;
+  }
+
+  // Orders that are done (filled or cancelled) are not referenced again.
+  void forget(uint32_t order_id) { orders.erase(order_id); }
+
+  size_t total_orders() {
+    while (read_one()) {
+    }
+    return num_orders;
+  }
+};
+
+class Checker {
+  InputLog &input;
+  std::unordered_map<uint64_t, InstrumentBook> books;
+  uint64_t seq{0};
+  size_t counter{0};
+
+  static bool fail(const OutputEvent &e, const std::string &why) {
+    std::cout << why << ": " << e << std::endl;
+    return false;
+  }
+
+  static void unbook(const Order &order) {
+    if (order.type == 'B') {
+      order.book->buys.erase(order.key);
+    } else {
+      order.book->sells.erase(order.key);
+    }
+  }
+
+  // The best order on the side of the book of this (resting) order.
+  std::optional<uint32_t> best(const Order &order) {
+    const auto &book =
+        order.book != nullptr ? *order.book : books[order.instrument];
+    return order.type == 'B' ? book.buys.best() : book.sells.best();
+  }
+
+  bool execute(const OutputEvent &e) {
+    // Reading further into the input (or forgetting an order) may move
+    // orders around in the table, so load both orders before taking
+    // references, and forget them only at the end.
+    input.at(e.order_id);
+    auto &active = input.at(e.new_id);
+    auto &resting = input.at(e.order_id);
+    if (resting.type == active.type) {
+      return fail(e, "Matching (execute) both same order type with "
+                     "each other");
+    }
+    auto top = best(resting);
+    if (!top) {
+      return fail(e, "No existing order in pq matched");
+    }
+    if (*top != e.order_id) {
+      return fail(e, "Did not match with best order " +
+                         std::to_string(*top));
+    }
+    if (resting.resting_count < e.count) {
+      return fail(e, "pq count less than matched count");
+    }
+
+    bool resting_done = resting.resting_count == e.count;
+    if (resting_done) {
+      unbook(resting);
+    } else {
+      resting.resting_count -= e.count;
+    }
+    active.count -= e.count;
+    int64_t active_left = active.count;
+
+    if (resting_done) {
+      input.forget(e.order_id);
+    }
+    if (active_left < 0) {
+      return fail(e, "active order count becomes < 0 after execution "
+                     "of this output");
+    }
+    if (active_left == 0) {
+      counter++;
+      input.forget(e.new_id);
+    }
+    return true;
+  }
+
+  bool add(const OutputEvent &e) {
+    counter++;
+    auto &order = input.at(e.order_id);
+    if (e.count != order.count) {
+      return fail(e, "Expected count is different. Expected count " +
+                         std::to_string(order.count));
+    }
+    if (order.booked) {
+      unbook(order);
+    }
+    order.type = e.type;
+    order.instrument = e.instrument;
+    order.booked = true;
+    order.resting_count = e.count;
+    order.key = Resting{e.price, e.input_time, seq++, e.order_id};
+    order.book = &books[e.instrument];
+    if (e.type == 'B') {
+      order.book->buys.insert(order.key);
+    } else {
+      order.book->sells.insert(order.key);
+    }
+    return true;
+  }
+
+  bool cancel(const OutputEvent &e) {
+    counter++;
+    Order *order = input.find_booked(e.order_id);
+    if (order) {
+      unbook(*order);
+      input.forget(e.order_id);
+    }
+    if (!order && e.cancel_status == 'A') {
+      return fail(e, "Cancellation of order should not be accepted");
+    } else if (order && e.cancel_status == 'R') {
+      return fail(e, "Cancellation of order should be accepted");
+    }
+    return true;
+  }
+
+ public:
+  explicit Checker(InputLog &input) : input{input} {}
+
+  // Output lines must be given in output timestamp order.
+  bool check(const OutputEvent &e) {
+    try {
+      switch (e.type) {
+        case 'E':
+          return execute(e);
+        case 'B':
+        case 'S':
+          return add(e);
+        case 'X':
+          return cancel(e);
+      }
+    } catch (const std::exception &exc) {
+      return fail(e, exc.what());
+    }
+    return true;
+  }
+
+  bool finish() {
+    size_t num_orders = input.total_orders();
+    if (counter != num_orders) {
+      std::cout << "Some orders didn't get executed, counter: " << counter
+                << " num orders: " << num_orders << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
+// Puts output lines back into (stable) output timestamp order. A line is
+// released once it is more than `window` older than the newest line seen.
+// Engine output is almost sorted already, so lines are kept in a sorted
+// deque and inserted by scanning back from the newest, which is O(1) for
+// in-order lines.
+class ReorderWindow {
+  int64_t window;
+  std::deque<OutputEvent> pending;
+  int64_t released{INT64_MIN};
+
+  template <typename F>
+  bool pop(F &&release) {
+    released = pending.front().output_time;
+    bool ok = release(pending.front());
+    pending.pop_front();
+    return ok;
+  }
+
+ public:
+  explicit ReorderWindow(int64_t window) : window{window} {}
+
+  template <typename F>
+  bool push(const OutputEvent &event, F &&release) {
+    if (event.output_time < released) {
+      std::cout << "Output arrived more than the reorder window after "
+                   "later outputs (try a larger --window-us): "
+                << event << std::endl;
+      return false;
+    }
+    if (pending.empty() || pending.back().output_time <= event.output_time) {
+      pending.push_back(event);
+    } else {
+      auto it = std::prev(pending.end());
+      while (it != pending.begin() &&
+             std::prev(it)->output_time > event.output_time) {
+        --it;
+      }
+      pending.insert(it, event);
+    }
+    int64_t newest = pending.back().output_time;
+    while (pending.front().output_time < newest - window) {
+      if (!pop(release)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  template <typename F>
+  bool drain(F &&release) {
+    while (!pending.empty()) {
+      if (!pop(release)) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+bool is_output_line(std::string_view line) {
+  return line.size() > 1 && line[1] == ' ' &&
+         (line[0] == 'B' || line[0] == 'S' || line[0] == 'E' ||
+          line[0] == 'X');
+}
+
+bool run(const char *input_path, const char *output_path,
+         int64_t window) {
+  InputLog input{input_path};
+  LineReader output{output_path};
+  Checker checker{input};
+  ReorderWindow reorder{window};
+  auto release = [&checker](const OutputEvent &event) {
+    return checker.check(event);
+  };
+
+  while (auto line = output.next()) {
+    if (!is_output_line(*line)) {
+      continue;
+    }
+    OutputEvent event;
+    try {
+      event = OutputEvent::parse(*line);
+    } catch (const std::exception &e) {
+      std::cout << "Could not parse output (" << e.what()
+                << "): " << *line << std::endl;
+      return false;
+    }
+    if (!reorder.push(event, release)) {
+      return false;
+    }
+  }
+  return reorder.drain(release) && checker.finish();
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  const char *paths[2] = {"input.txt", "output.txt"};
+  int num_paths = 0;
+  int64_t window = 1'000'000;  // engine timestamps are in microseconds
+  bool timing = false;
+  for (int i = 1; i < argc; ++i) {
+    if (std::string_view{argv[i]} == "--window-us" && i + 1 < argc) {
+      window = std::stoll(argv[++i]);
+    } else if (std::string_view{argv[i]} == "--timing") {
+      timing = true;
+    } else if (num_paths < 2) {
+      paths[num_paths++] = argv[i];
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [input.txt] [output.txt] [--window-us N] [--timing]"
+                << std::endl;
+      return 2;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  bool passed = false;
+  try {
+    passed = run(paths[0], paths[1], window);
+  } catch (const std::exception &e) {
+    std::cout << e.what() << std::endl;
+  }
+  if (timing) {
+    std::chrono::duration<double> took =
+        std::chrono::steady_clock::now() - start;
+    double mb = LineReader::bytes_read / 1e6;
+    std::cerr << "Read " << mb << " MB in " << took.count() << " s ("
+              << mb / took.count() << " MB/s)" << std::endl;
+  }
+  std::cout << (passed ? "Passed" : "Failed") << std::endl;
+  return passed ? 0 : 1;
+}